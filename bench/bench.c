@@ -0,0 +1,356 @@
+/*
+ * Shell overhead benchmark harness
+ * Generates reproducible workloads, runs the shell on each repeatedly and
+ * reports per-run and per-command latency percentiles.
+ * C17, POSIX; built and run by `make bench`.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Defaults; override with BENCH_REPS / BENCH_SCALE / BENCH_ARGS.
+#define DEFAULT_REPS 15
+#define DEFAULT_SCALE 1
+#define DEFAULT_HUGE_ARGS 4096   // a glob-sized argument list
+
+// One workload: a generated script and how many commands it runs.
+typedef struct {
+    const char *name;
+    const char *description;
+    char path[512];
+    long commands;
+} BenchCase;
+
+// Latency summary of one workload, in nanoseconds per shell run.
+typedef struct {
+    uint64_t min;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+    double mean;
+} BenchStats;
+
+static char bench_dir[] = "/tmp/myshell-bench-XXXXXX";
+
+/*
+ * Read the monotonic clock in nanoseconds
+ */
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Read a positive integer from the environment
+ */
+static long env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+    char *end;
+
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed < 1) {
+        fprintf(stderr, "bench: %s: invalid value '%s'\n", name, value);
+        exit(2);
+    }
+    return parsed;
+}
+
+/*
+ * Open a new script file for a workload
+ */
+static FILE *case_open(BenchCase *bc, const char *name, const char *description) {
+    bc->name = name;
+    bc->description = description;
+    bc->commands = 0;
+    snprintf(bc->path, sizeof(bc->path), "%s/%s.sh", bench_dir, name);
+
+    FILE *fp = fopen(bc->path, "w");
+    if (fp == NULL) {
+        perror(bc->path);
+        exit(1);
+    }
+    return fp;
+}
+
+/*
+ * Finish a script file, aborting on write errors
+ */
+static void case_close(BenchCase *bc, FILE *fp) {
+    if (ferror(fp) || fclose(fp) != 0) {
+        perror(bc->path);
+        exit(1);
+    }
+}
+
+/*
+ * Generate every workload script into bench_dir
+ * Returns: number of cases written to cases[]
+ */
+static int generate_cases(BenchCase *cases, long scale, long huge_args) {
+    int n = 0;
+    FILE *fp;
+
+    // Thousands of external launches: pure fork/spawn + exec overhead.
+    fp = case_open(&cases[n], "true_external", "external /bin/true launches");
+    for (long i = 0; i < 2000 * scale; i++) {
+        fputs("/bin/true\n", fp);
+        cases[n].commands++;
+    }
+    case_close(&cases[n++], fp);
+
+    // The same count through the builtin: parse + dispatch only.
+    fp = case_open(&cases[n], "true_builtin", "builtin true invocations");
+    for (long i = 0; i < 20000 * scale; i++) {
+        fputs("true\n", fp);
+        cases[n].commands++;
+    }
+    case_close(&cases[n++], fp);
+
+    // A long generated script of mixed builtins, as our job scripts are.
+    fp = case_open(&cases[n], "builtin_script", "generated script of builtins");
+    for (long i = 0; i < 5000 * scale; i++) {
+        fprintf(fp, "echo line %ld of the generated script\n", i);
+        fprintf(fp, "test -d /tmp\n");
+        fprintf(fp, "[ %ld -lt 1000000 ]\n", i);
+        fprintf(fp, "printf %%s-%%d\\n item %ld\n", i);
+        cases[n].commands += 4;
+    }
+    case_close(&cases[n++], fp);
+
+    // A polling loop unrolled: the same few lines over and over.
+    fp = case_open(&cases[n], "repeated_script", "identical lines, as a polling loop");
+    for (long i = 0; i < 5000 * scale; i++) {
+        fputs("test -d /tmp\n", fp);
+        fputs("[ -e /tmp/myshell-bench-lock ]\n", fp);
+        fputs("echo 'still waiting' for the lock\n", fp);
+        fputs("true\n", fp);
+        cases[n].commands += 4;
+    }
+    case_close(&cases[n++], fp);
+
+    // Deep pipelines: stage setup cost dominates.
+    fp = case_open(&cases[n], "deep_pipeline", "32-stage /bin/cat pipelines");
+    for (long i = 0; i < 20 * scale; i++) {
+        fputs("echo data", fp);
+        for (int stage = 0; stage < 32; stage++) {
+            fputs(" | /bin/cat", fp);
+        }
+        fputc('\n', fp);
+        cases[n].commands += 33;
+    }
+    case_close(&cases[n++], fp);
+
+    // Background-job storm: launch many '&' jobs then wait for all.
+    fp = case_open(&cases[n], "background_storm", "/bin/true & jobs, then wait");
+    for (long i = 0; i < 500 * scale; i++) {
+        fputs("/bin/true &\n", fp);
+        cases[n].commands++;
+    }
+    fputs("wait\n", fp);
+    case_close(&cases[n++], fp);
+
+    // One huge line, as a glob over a large directory produces, repeated.
+    fp = case_open(&cases[n], "huge_line", "echo with a glob-sized argument list");
+    for (long i = 0; i < 200 * scale; i++) {
+        fputs("echo", fp);
+        for (long arg = 0; arg < huge_args - 1; arg++) {
+            fprintf(fp, " argument-%05ld", arg);
+        }
+        fputc('\n', fp);
+        cases[n].commands++;
+    }
+    case_close(&cases[n++], fp);
+
+    return n;
+}
+
+/*
+ * Run the shell once on a script with stdin/stdout on /dev/null
+ * Returns: wall time in nanoseconds, or 0 if the run failed
+ */
+static uint64_t run_once(const char *shell, const char *script) {
+    posix_spawn_file_actions_t actions;
+    char *argv[] = { (char *)shell, (char *)script, NULL };
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    uint64_t started = monotonic_ns();
+    int err = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        fprintf(stderr, "bench: %s: %s\n", shell, strerror(err));
+        return 0;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return 0;
+        }
+    }
+    uint64_t elapsed = monotonic_ns() - started;
+
+    if (!WIFEXITED(status)) {
+        fprintf(stderr, "bench: %s: shell terminated abnormally\n", script);
+        return 0;
+    }
+    return elapsed;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of sorted samples
+ */
+static uint64_t percentile(const uint64_t *sorted, long count, double pct) {
+    long rank = (long)(pct / 100.0 * (double)count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
+/*
+ * Summarise the samples of one case
+ */
+static BenchStats summarise(uint64_t *samples, long count) {
+    BenchStats stats;
+    double total = 0;
+
+    qsort(samples, (size_t)count, sizeof(uint64_t), compare_u64);
+    for (long i = 0; i < count; i++) {
+        total += (double)samples[i];
+    }
+
+    stats.min = samples[0];
+    stats.p50 = percentile(samples, count, 50);
+    stats.p90 = percentile(samples, count, 90);
+    stats.p99 = percentile(samples, count, 99);
+    stats.max = samples[count - 1];
+    stats.mean = total / (double)count;
+    return stats;
+}
+
+/*
+ * Remove the generated scripts
+ */
+static void cleanup(const BenchCase *cases, int count) {
+    for (int i = 0; i < count; i++) {
+        unlink(cases[i].path);
+    }
+    rmdir(bench_dir);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <shell> [report-file]\n", argv[0]);
+        return 2;
+    }
+
+    const char *shell = argv[1];
+    const char *report_path = argc == 3 ? argv[2] : "bench_output.txt";
+    long reps = env_long("BENCH_REPS", DEFAULT_REPS);
+    long scale = env_long("BENCH_SCALE", DEFAULT_SCALE);
+    long huge_args = env_long("BENCH_ARGS", DEFAULT_HUGE_ARGS);
+    const char *backend = getenv("MYSHELL_SPAWN");
+
+    if (mkdtemp(bench_dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    BenchCase cases[8];
+    int ncases = generate_cases(cases, scale, huge_args);
+
+    FILE *report = fopen(report_path, "w");
+    if (report == NULL) {
+        perror(report_path);
+        cleanup(cases, ncases);
+        return 1;
+    }
+
+    uint64_t *samples = calloc((size_t)reps, sizeof(uint64_t));
+    if (samples == NULL) {
+        perror("calloc");
+        cleanup(cases, ncases);
+        return 1;
+    }
+
+    printf("shell %s, backend %s, %ld reps, scale %ld\n\n", shell,
+           backend ? backend : "default", reps, scale);
+    printf("%-18s %8s %10s %10s %10s %12s\n",
+           "case", "cmds", "p50 ms", "p99 ms", "mean ms", "p50 us/cmd");
+
+    int status = 0;
+    for (int c = 0; c < ncases; c++) {
+        BenchCase *bc = &cases[c];
+        bool failed = false;
+
+        // One untimed warm-up run fills the page cache and PATH lookups.
+        run_once(shell, bc->path);
+        for (long r = 0; r < reps; r++) {
+            samples[r] = run_once(shell, bc->path);
+            if (samples[r] == 0) {
+                failed = true;
+                break;
+            }
+        }
+        if (failed) {
+            printf("%-18s %8s\n", bc->name, "FAILED");
+            status = 1;
+            continue;
+        }
+
+        BenchStats st = summarise(samples, reps);
+        double per_cmd_us = (double)st.p50 / 1e3 / (double)bc->commands;
+
+        printf("%-18s %8ld %10.2f %10.2f %10.2f %12.2f\n", bc->name, bc->commands,
+               (double)st.p50 / 1e6, (double)st.p99 / 1e6, st.mean / 1e6, per_cmd_us);
+
+        // One JSON object per line keeps reports diffable between releases.
+        fprintf(report,
+                "{\"case\":\"%s\",\"description\":\"%s\",\"backend\":\"%s\","
+                "\"reps\":%ld,\"commands\":%ld,\"min_ns\":%llu,\"p50_ns\":%llu,"
+                "\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"mean_ns\":%.0f,"
+                "\"p50_ns_per_command\":%.1f}\n",
+                bc->name, bc->description, backend ? backend : "default", reps,
+                bc->commands, (unsigned long long)st.min, (unsigned long long)st.p50,
+                (unsigned long long)st.p90, (unsigned long long)st.p99,
+                (unsigned long long)st.max, st.mean, (double)st.p50 / (double)bc->commands);
+    }
+
+    printf("\nreport written to %s\n", report_path);
+    fclose(report);
+    free(samples);
+    cleanup(cases, ncases);
+    return status;
+}
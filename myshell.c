@@ -4,7 +4,7 @@
  * C17 compliant with clean architecture
  */
 
- #define _POSIX_C_SOURCE 200809L
+ #define _GNU_SOURCE
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
@@ -12,12 +12,79 @@
  #include <sys/wait.h>
  #include <errno.h>
  #include <stdbool.h>
+ #include <stddef.h>
  #include <signal.h>
+ #include <spawn.h>
+ #include <sys/stat.h>
+ #include <sys/mman.h>
+ #include <sys/sendfile.h>
+ #include <ctype.h>
+ #include <stdarg.h>
+ #include <limits.h>
+ #include <fcntl.h>
+ #include <poll.h>
+ #include <stdint.h>
+ #include <time.h>
+ #include <sys/time.h>
+ #include <sys/resource.h>
+ #include <dirent.h>
+ #include <fnmatch.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <sys/ioctl.h>
+ #include <termios.h>
+ #include <sys/syscall.h>
+ #include <linux/sched.h>
+ #include <linux/mempolicy.h>
+ #include <sched.h>
+
+extern char **environ;
 
 //  Configuration constants.
-#define MAX_INPUT_SIZE 1024
-#define MAX_ARGS 64
-#define MAX_TOKEN_SIZE 256
+#define INITIAL_ARGS 8        // argv slots per stage before growing
+#define INITIAL_CWD_SIZE 256
+#define PARSE_CACHE_BUCKETS 1024
+#define PARSE_CACHE_MAX_ENTRIES 1024
+#define PARSE_CACHE_MAX_LINE 1024   // longer lines are parsed every time
+#define PATH_CACHE_BUCKETS 256
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
+#define INPUT_BLOCK_SIZE 65536
+#define ARENA_CHUNK_SIZE 16384
+#define MAX_REDIRECTS 16
+#define COPY_CHUNK_SIZE (1 << 20)
+#define MAX_BUILTINS 64
+#define BUILTIN_INDEX_SIZE 128   // power of two, at least 2 * MAX_BUILTINS
+#define OUT_BUFFER_SIZE 8192
+#define MAX_DONE_JOBS 1024   // finished jobs remembered for wait/jobs
+#define MAX_EVENT_SOURCES 16
+#define VAR_BUCKETS 512
+#define HISTORY_INITIAL_CAP 1024
+#define TRIGRAM_INITIAL_SLOTS 4096   // power of two
+#define EDITOR_LINE_SIZE 256
+#define EDITOR_OUT_SIZE 4096
+#define EDITOR_SEARCH_MAX 128
+#define EDITOR_ESC_TIMEOUT_MS 50   // a lone ESC is a key, not a sequence
+#define COMPLETION_LIST_MAX 200    // more candidates are only counted
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_MAX_BYTES (64u << 20)   // listings dropped past this
+#define DENTS_BUFFER_SIZE (256 * 1024)
+#define GLOB_MAX_THREADS 8
+#define SERVER_BACKLOG 64
+#define FD_PROBE_COUNT 64   // descriptors highest_open_fd() checks with one poll()
+#define SERVER_STATUS_MARK '\036'   // starts each --server reply frame
+#define MAX_CHILD_RLIMITS 3
+#define CGROUP_ROOT "/sys/fs/cgroup"   // relative limit -g names live here
+#define MAX_NUMA_NODES 64   // node ids past this are ignored (one nodemask word)
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define TRACE_RING_SLOTS 4096        // power of two; records past this are dropped
+#define TRACE_COMMAND_MAX 160        // command text kept per trace record
+#define TRACE_WRITE_BUFFER 65536
+#define TRACE_RECORD_MAX 2048        // one formatted record, escaping included
+#define TRACE_IDLE_MS 10             // writer sleep when the ring is empty
+#define XARGS_HEADROOM 2048          // ARG_MAX slack left for the exec'd program
+#define XARGS_ITEM_MAX (32 * 4096)   // Linux MAX_ARG_STRLEN, per argument
 
 // color codes for enhanced UX
 #define COLOR_RESET     "\033[0m"
@@ -25,323 +92,8753 @@
 #define COLOR_ERROR   "\033[1;31m"
 #define COLOR_SUCCESS "\033[1;32m"
 
-// Command structure for parsed input.
+// Launch backends for external commands.
+// posix_spawn avoids copying the shell's page tables (glibc implements it
+// with clone(CLONE_VM | CLONE_VFORK)); fork remains available for children
+// that need arbitrary setup between fork and exec.
+typedef enum {
+    SPAWN_BACKEND_FORK,
+    SPAWN_BACKEND_POSIX_SPAWN,
+} SpawnBackend;
+
+// Compile-time default; override at runtime with MYSHELL_SPAWN=fork|posix_spawn.
+#ifndef DEFAULT_SPAWN_BACKEND
+#define DEFAULT_SPAWN_BACKEND SPAWN_BACKEND_POSIX_SPAWN
+#endif
+
+// close_range() and posix_spawn_file_actions_addclosefrom_np() arrived
+// together in glibc 2.34, which also defines CLOSE_RANGE_CLOEXEC.
+#if defined(CLOSE_RANGE_CLOEXEC) && !defined(HAVE_CLOSE_RANGE)
+#define HAVE_CLOSE_RANGE 1
+#endif
+
+// clone3() with CLONE_INTO_CGROUP needs Linux 5.7 headers; without it a
+// limited child moves itself into its cgroup through cgroup.procs.
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP) && !defined(HAVE_CLONE3)
+#define HAVE_CLONE3 1
+#endif
+
+// Lexer character classes, see char_class[].
+enum {
+    CC_WORD = 0,
+    CC_END,
+    CC_BLANK,
+    CC_OPERATOR,
+    CC_QUOTE,
+    CC_DOLLAR,
+    CC_GLOB,
+};
+
+// A '$' that starts an expansion is stored in the cooked word as one of
+// these bytes, so cached trees keep it and quoting is not lost; the
+// executor expands them. Unquoted results are field-split, quoted not.
+#define EXPAND_MARK '\001'
+#define EXPAND_MARK_QUOTED '\002'
+
+// Unquoted * ? and [ are stored as these bytes for the same reason, so a
+// quoted "*" stays literal. Words holding them are globbed after
+// expansion and fall back to the plain spelling when nothing matches.
+#define GLOB_STAR '\003'
+#define GLOB_QUESTION '\004'
+#define GLOB_BRACKET '\005'
+
+// Redirection operators recognised by lex_next().
+typedef enum {
+    REDIR_INPUT,    // [n]<file
+    REDIR_OUTPUT,   // [n]>file
+    REDIR_APPEND,   // [n]>>file
+    REDIR_DUP,      // [n]>&m
+} RedirType;
+
+// One redirection, applied in source order after the pipe ends.
+typedef struct Redirect {
+    RedirType type;
+    int fd;                 // Descriptor being redirected in the child
+    const char *target;     // File name (REDIR_DUP: source descriptor)
+    struct Redirect *next;
+} Redirect;
+
+// Lexical token kinds produced by lex_next().
+typedef enum {
+    TOK_EOF,
+    TOK_WORD,
+    TOK_PIPE,       // |
+    TOK_AMP,        // &
+    TOK_AND_IF,     // &&
+    TOK_OR_IF,      // ||
+    TOK_SEMI,       // ;
+    TOK_REDIR,      // [n]< [n]> [n]>> [n]>&
+} TokenKind;
+
+// One token; words are spans of the (unquoted, in-place) input line.
+typedef struct {
+    TokenKind kind;
+    char *text;             // TOK_WORD: NUL-terminated word
+    size_t len;
+    size_t plain_len;       // Leading bytes that were not quoted or escaped
+    bool expand;            // Contains an EXPAND_MARK or GLOB_ byte
+    RedirType redir;        // TOK_REDIR: operator and descriptor
+    int fd;
+} Token;
+
+// Single-pass lexer state over one line.
+// A word glued to an operator ("a|b") has no spare byte for its NUL, so
+// the operator is lexed early into pending before the terminator lands.
+typedef struct {
+    char *pos;
+    Token pending;
+    bool has_pending;
+} Lexer;
+
+// Child setup steps whose failure a forked child sends up its report
+// pipe, as a ChildFailure, for the parent to print.
+typedef enum {
+    CHILD_STEP_EXEC,
+    CHILD_STEP_FDS,
+    CHILD_STEP_CGROUP,
+    CHILD_STEP_RLIMIT,
+    CHILD_STEP_PLACEMENT,
+} ChildStep;
+
 typedef struct {
-    char *args[MAX_ARGS];
+    int step;               // ChildStep
+    int err;                // errno
+} ChildFailure;
+
+// Resource caps and placement for the children of one command, set up
+// by limit and parallel -P. cgroup_fd is a cgroup v2 directory the child
+// starts in; procs_fd is the cgroup.procs file in it, used when clone3()
+// cannot place the child; both are -1 when there is no cgroup.
+typedef struct {
+    int nrlimits;
+    int resource[MAX_CHILD_RLIMITS];
+    rlim_t value[MAX_CHILD_RLIMITS];
+    int cgroup_fd;
+    int procs_fd;
+    bool pin_cpus;          // sched_setaffinity() to cpus
+    cpu_set_t cpus;
+    bool bind_memory;       // set_mempolicy(MPOL_BIND) to mem_node
+    int mem_node;
+} ChildLimits;
+
+// Placement policies of parallel -P.
+typedef enum {
+    PLACE_NONE,
+    PLACE_ROUND_ROBIN,      // task k on the k-th allowed CPU
+    PLACE_NODE,             // every task on one node's CPUs and memory
+    PLACE_SPREAD,           // task k on the k-th node, CPUs and memory
+} PlacePolicy;
+
+// CPUs the shell may run on and the NUMA nodes over them, read once.
+// Nodes without allowed CPUs (memory-only or masked off) have ncpus 0.
+typedef struct {
+    bool loaded;
+    cpu_set_t allowed;
+    int ncpus;
+    int cpus[CPU_SETSIZE];
+    int nnodes;
+    int node_id[MAX_NUMA_NODES];
+    int node_ncpus[MAX_NUMA_NODES];
+    cpu_set_t node_cpus[MAX_NUMA_NODES];
+} CpuTopology;
+
+// Command structure for one pipeline stage.
+// args is a NULL-terminated vector in the parse arena, doubled as it
+// fills; the strings it points at live in the line buffer.
+typedef struct Command {
+    char **args;
     int argc;
-    bool background;
+    int args_cap;
+    size_t arg_bytes;       // Bytes execve() needs for args, checked against ARG_MAX
+    char **assigns;         // Leading NAME=value words, same layout as args
+    int nassigns;
+    int assigns_cap;
+    bool expand;            // A word or target holds EXPAND_MARK or GLOB_ bytes
+    Redirect *redirs;
+    int nredirs;
+    const ChildLimits *limits;   // Caps for this stage's child, or NULL
+    struct Command *next;   // Next stage, fed by this stage's stdout
 } Command;
 
+// Descriptor moves for a child: dup2(source[i], target[i]) in order.
+// Sources the parent opened for redirections are owned and closed by it.
+typedef struct {
+    int count;
+    int source[MAX_REDIRECTS + 2];
+    int target[MAX_REDIRECTS + 2];
+    bool owned[MAX_REDIRECTS + 2];
+} FdPlan;
+
+// How a pipeline is joined to the one after it in a command list.
+typedef enum {
+    CONNECT_SEQ,    // ; & or end of line: always run the next
+    CONNECT_AND,    // &&: run the next only on success
+    CONNECT_OR,     // ||: run the next only on failure
+} Connector;
+
+// One pipeline of a command list: stages joined by '|'. A parsed line
+// is the list of pipelines chained through next.
+typedef struct Pipeline {
+    Command *first;
+    int nstages;
+    bool background;
+    Connector connector;    // Join to next
+    struct Pipeline *next;
+} Pipeline;
+
+// One block of arena memory; chunks are chained and reused across resets.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} ArenaChunk;
+
+// Bump allocator for per-line parse state, reset once per REPL iteration.
+typedef struct {
+    ArenaChunk *head;
+    ArenaChunk *current;
+} Arena;
+
+// Source of command lines: a -c string, an mmap'd script file, or a
+// descriptor read in large blocks. Lines are NUL-terminated in place and
+// handed to the parser straight out of buf.
+typedef struct {
+    char *buf;          // Current input bytes
+    size_t len;         // Valid bytes in buf
+    size_t pos;         // Start of the next unread line
+    size_t cap;         // Allocated size of a block buffer (0 if not owned)
+    size_t map_len;     // Length of an mmap'd script (0 if not mapped)
+    char *tail;         // Copy of a mapping's final unterminated line
+    int fd;             // Descriptor to refill from, or -1
+    size_t keep;        // Refills preserve bytes from here on (SIZE_MAX: none)
+    bool eof;
+} InputSource;
+
+// Builtin handler: runs in the shell (or a pipeline child), returns status.
+typedef int (*BuiltinFn)(Command *cmd);
+
+// Registry entry for a builtin command.
+typedef struct {
+    const char *name;
+    BuiltinFn handler;
+    const char *synopsis;   // Shown by help, e.g. "cd [dir]"
+    const char *summary;
+} BuiltinDef;
+
+// Buffered writer for builtin output, flushed at command boundaries.
+typedef struct {
+    char data[OUT_BUFFER_SIZE];
+    size_t len;
+} OutBuffer;
+
+// Background job: every process of one '&' pipeline.
+typedef struct {
+    int id;                 // Job number shown as [n] and used as %n
+    pid_t *pids;            // One per launched stage, negated once reaped
+    int npids;
+    int nlive;              // Stages not yet reaped
+    int status;             // Exit code of the last stage once done
+    bool done;
+    char *command;          // Command text for jobs listings
+} Job;
+
+// Table of background jobs, oldest first.
+typedef struct {
+    Job *jobs;
+    size_t count;
+    size_t capacity;
+} JobTable;
+
+// Cumulative shell-side costs and reaped-child resources, sampled
+// before and after a command by time / set -o timing.
+typedef struct {
+    uint64_t lookup_ns;     // PATH resolution in execute_external()
+    uint64_t spawn_ns;      // fork/posix_spawn until the parent resumes
+    unsigned long launches;
+    struct timeval child_utime;
+    struct timeval child_stime;
+    long child_maxrss;      // Largest ru_maxrss seen since the last reset
+    long child_nvcsw;
+    long child_nivcsw;
+    uint64_t wait_ns;       // Blocked in wait_pipeline()
+    pid_t last_pid;         // Last child execute_command() launched
+} ShellCounters;
+
+// One command as recorded by set -o trace, filled in by the shell thread.
+typedef struct {
+    uint64_t start_ns;      // CLOCK_MONOTONIC, shared by every shell on the host
+    uint64_t end_ns;
+    uint64_t parse_ns;      // Parsing the line the command came from
+    uint64_t lookup_ns;
+    uint64_t spawn_ns;
+    uint64_t wait_ns;
+    struct timeval utime;   // Reaped children only
+    struct timeval stime;
+    long maxrss;
+    long nvcsw;
+    long nivcsw;
+    pid_t pid;              // Last stage's child, 0 if it ran in the shell
+    int status;
+    int nstages;
+    bool background;
+    char command[TRACE_COMMAND_MAX];
+} TraceRecord;
+
+// Single-producer ring between the shell and the trace writer thread.
+// The shell only copies counters into a slot and publishes head; the
+// writer formats, writes and advances tail. A full ring drops records
+// rather than ever making the shell wait.
+typedef struct {
+    TraceRecord *slots;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    atomic_bool stop;
+    atomic_ulong dropped;
+    bool enabled;
+    bool chrome;            // Chrome trace events, else JSON lines
+    int fd;
+    pid_t owner;            // Process the writer thread runs in
+    pthread_t writer;
+} TraceRing;
+
+// A boolean shell option toggled with set -o / set +o.
+typedef struct {
+    const char *name;
+    bool *flag;
+    const char *summary;
+} ShellOption;
+
+// Parsed form of one source line, kept for re-execution.
+typedef struct ParsedLine {
+    size_t hash;
+    size_t len;
+    char *text;             // Line as read, before in-place unquoting
+    Pipeline *pipeline;     // Shared by every execution; read-only
+    struct ParsedLine *next;
+} ParsedLine;
+
+// Line-text-to-tree table. Entries live in the cache's own arena and are
+// dropped together when the table fills.
+typedef struct {
+    ParsedLine *buckets[PARSE_CACHE_BUCKETS];
+    Arena arena;
+    size_t count;
+} ParseCache;
+
+// Callback for a ready descriptor; revents is the poll() result.
+typedef void (*EventHandler)(int fd, short revents, void *data);
+
+// One descriptor watched while the shell waits for input.
+typedef struct {
+    int fd;
+    short events;
+    EventHandler handler;
+    void *data;
+} EventSource;
+
+// Descriptors serviced by event_wait_readable(), besides the input.
+typedef struct {
+    EventSource sources[MAX_EVENT_SOURCES];
+    size_t count;
+} EventLoop;
+
+// One shell variable. entry holds "NAME=value" so exported variables go
+// into envp as they are.
+typedef struct Var {
+    char *entry;
+    size_t name_len;
+    bool exported;
+    struct Var *next;
+} Var;
+
+// Hashed shell variables plus the envp handed to children, rebuilt only
+// after an exported variable changes.
+typedef struct {
+    Var *buckets[VAR_BUCKETS];
+    size_t nexported;
+    char **envp;
+    size_t envp_cap;
+    bool envp_stale;
+} VarStore;
+
+// Value a prefix assignment replaced while a builtin ran.
+typedef struct {
+    char *entry;            // Previous "NAME=value", NULL if it was unset
+    bool exported;
+} SavedVar;
+
+// Entries of one directory as read by getdents64(), shared by globs.
+// Valid while the directory's mtime is unchanged; names point into blob.
+typedef struct DirListing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool trusted;           // Scanned well after mtime; same mtime means same entries
+    size_t count;
+    char **names;
+    unsigned char *types;   // d_type per name, DT_UNKNOWN if the fs gives none
+    char *blob;
+    size_t bytes;           // Memory held, counted against DIR_CACHE_MAX_BYTES
+    struct DirListing *next;
+} DirListing;
+
+// Directory listings keyed by (dev, inode). Glob workers look up and
+// insert under lock; replaced listings are retired and freed by the
+// main thread between globs, so a worker never sees one disappear.
+typedef struct {
+    DirListing *buckets[DIR_CACHE_BUCKETS];
+    DirListing *retired;
+    size_t bytes;
+    pthread_mutex_t lock;
+    atomic_int pinned;      // Background readers; no freeing while nonzero
+} DirCache;
+
+// One word to glob and the matches found for it.
+typedef struct {
+    const char *word;
+    Arena *arena;
+    char **matches;
+    int count;
+    int cap;
+} GlobJob;
+
+// Words of one stage shared out to glob workers.
+typedef struct {
+    GlobJob *jobs;
+    size_t count;
+    atomic_size_t next;     // Next job to hand out
+} GlobPool;
+
+// A glob thread and the arena its matches go into.
+typedef struct {
+    GlobPool *pool;
+    Arena *arena;
+} GlobWorker;
+
+// Cached PATH resolution for one command name.
+typedef struct PathEntry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct PathEntry *next;
+} PathEntry;
+
+// Command-to-absolute-path table, filled lazily by lookup_command().
+typedef struct {
+    PathEntry *buckets[PATH_CACHE_BUCKETS];
+    char *path_snapshot;    // $PATH the entries were resolved against
+    size_t count;
+    unsigned long hits;
+    unsigned long misses;
+} PathCache;
+
+// Entry ids of history lines containing one trigram, oldest first.
+typedef struct {
+    uint32_t key;           // Three bytes plus one, 0 for an empty slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *ids;
+} TrigramPosting;
+
+// Open-addressing map from trigram to posting list.
+typedef struct {
+    TrigramPosting *slots;
+    size_t cap;             // Power of two
+    size_t used;
+    size_t indexed;         // History entries added so far
+} TrigramIndex;
+
+// Command history. The file is the only copy: it is mapped read-only and
+// indexed by record offsets, and new lines are appended with a single
+// O_APPEND write() each, so concurrent shells interleave whole lines.
+typedef struct {
+    int fd;
+    char *map;
+    size_t map_len;
+    size_t *offsets;        // Start of each record; offsets[count] ends the last
+    size_t count;
+    size_t cap;
+    TrigramIndex trigrams;  // Built on the first search, then kept current
+    bool ready;
+} History;
+
+// Executables found in one PATH directory, as of its (dev, inode, mtime).
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool trusted;           // Listing can be reused while mtime is unchanged
+    bool missing;
+    char **names;           // Point into blob
+    size_t count;
+    char *blob;
+} CompletionDir;
+
+// Command names for Tab completion: builtins plus every executable on
+// PATH, merged into one sorted array searched by prefix. The first build
+// runs on a background thread while the user types.
+typedef struct {
+    char *path_snapshot;    // $PATH the directories came from
+    CompletionDir *dirs;
+    size_t ndirs;
+    const char **names;
+    size_t count;
+    pthread_t builder;
+    bool building;
+} CompletionTable;
+
+// One candidate offered for the word being completed.
+typedef struct {
+    const char *name;
+    bool is_dir;
+} CompletionMatch;
+
+// Candidates for one Tab press.
+typedef struct {
+    CompletionMatch *matches;
+    size_t count;
+    size_t cap;
+} Completion;
+
+// Keys the line editor decodes from escape sequences; plain bytes and
+// control characters stand for themselves.
+enum {
+    EDITOR_KEY_ESC = 256,
+    EDITOR_KEY_UP,
+    EDITOR_KEY_DOWN,
+    EDITOR_KEY_LEFT,
+    EDITOR_KEY_RIGHT,
+    EDITOR_KEY_HOME,
+    EDITOR_KEY_END,
+    EDITOR_KEY_DELETE,
+    EDITOR_KEY_WORD_LEFT,
+    EDITOR_KEY_WORD_RIGHT,
+};
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+// Raw-mode line editor for an interactive terminal. The screen shows the
+// prompt and buf; each block of input is applied to buf and answered by
+// one write() that redraws from the first changed byte only.
+typedef struct {
+    char *buf;              // Line being edited, NUL-terminated
+    size_t len;
+    size_t cap;
+    size_t cursor;          // Byte offset of the cursor in buf
+    size_t term_col;        // Terminal cursor, in columns from the prompt start
+    size_t shown_cols;      // Columns of prompt and line on screen
+    size_t cols;            // Terminal width
+    const char *shell_prompt;
+    const char *prompt;     // Shell prompt, or the search prompt
+    size_t prompt_cols;
+    char *out;              // Terminal output queued for the next write()
+    size_t out_len;
+    size_t out_cap;
+    struct termios saved;   // Settings restored before a command runs
+    bool raw;
+    bool active;            // Reading a line: notices must redraw it
+    int usable;             // 0 not yet checked, 1 yes, -1 no
+    long history_pos;       // Entry shown while browsing history, -1 if none
+    char *stash;            // Typed line put aside while browsing or searching
+    bool searching;         // Ctrl-R reverse search in progress
+    char search[EDITOR_SEARCH_MAX];
+    size_t search_len;
+    long search_match;
+    char search_prompt[EDITOR_SEARCH_MAX + 32];
+} LineEditor;
 
 // Forward declarations.
 static void display_prompt(void);
-static char *read_line(void);
-static Command *parse_line(char *line);
-static int execute_command(Command *cmd);
+static const char *current_directory(void);
+static void set_shell_cwd(const char *dir);
+static void init_shell_cwd(void);
+static bool input_open_string(InputSource *in, char *text);
+static bool input_open_file(InputSource *in, const char *path);
+static bool input_open_fd(InputSource *in, int fd);
+static char *input_next_line(InputSource *in);
+static char *input_next_record(InputSource *in, char sep);
+static void input_close(InputSource *in);
+static bool history_init(void);
+static void history_refresh(void);
+static void history_add(const char *line);
+static const char *history_entry(size_t i, size_t *len);
+static long history_search(const char *needle, long before);
+static void trigram_index_clear(TrigramIndex *index);
+static void completion_start(void);
+static CompletionTable *completion_commands(void);
+static bool editor_available(void);
+static char *editor_read_line(InputSource *in);
+static void editor_suspend(void);
+static void editor_resume(void);
+static void *arena_alloc(Arena *arena, size_t size);
+static void arena_reset(Arena *arena);
+static char *arena_strndup(Arena *arena, const char *str, size_t len);
+static Pipeline *parse_line(char *line, Arena *arena);
+static Pipeline *parse_cached(char *line, Arena *arena);
+static size_t hash_string(const char *str);
+static void var_import(char **env);
+static void vars_init(void);
+static void startup_phase(const char *phase);
+static void startup_lazy(const char *phase, uint64_t start);
+static const char *var_get(const char *name);
+static bool var_assign(const char *assignment, bool export);
+static bool var_set(const char *name, const char *value, bool export);
+static void var_unset(const char *name);
+static char **var_envp(void);
+static char **command_envp(const Command *cmd);
+static bool glob_command(Command *cmd);
+static DirListing *dir_listing(const char *path);
+static Pipeline *expand_pipeline(Pipeline *pipeline);
+static int execute_command(Pipeline *pipeline);
+static int execute_list(Pipeline *list);
+static bool register_builtin(const BuiltinDef *def);
+static const BuiltinDef *find_builtin(const char *name);
+static bool is_builtin(const char *name);
 static int execute_builtin(Command *cmd);
-static int execute_external(Comand *cmd);
-static void free_command(Command *cmd);
-static void setup_signal_handlers(void);
+static pid_t execute_external(Command *cmd, const FdPlan *plan);
+static pid_t spawn_builtin_stage(Command *cmd, const FdPlan *plan);
+static pid_t launch_stage(Command *cmd, const FdPlan *plan);
+static pid_t spawn_resolved(Command *cmd, const char *path, const FdPlan *plan);
+static pid_t spawn_with_fork(Command *cmd, const char *path, const FdPlan *plan);
+static pid_t spawn_limited(Command *cmd, const char *path, const FdPlan *plan);
+static pid_t clone_limited(const ChildLimits *limits, bool allow_clone3, int report_fd);
+static bool apply_placement(const ChildLimits *limits);
+static const CpuTopology *cpu_topology(void);
+static bool parse_cpu_list(const char *text, cpu_set_t *set);
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size);
+static void format_placement(const cpu_set_t *cpus, int node, char *buf, size_t size);
+static bool place_on_node(int node, ChildLimits *limits);
+static void place_task(PlacePolicy policy, int node, long seq, ChildLimits *limits);
+static pid_t spawn_with_posix_spawn(Command *cmd, const char *path,
+                                    const FdPlan *plan);
+static pid_t spawn_sh_script(Command *cmd, const char *path, const FdPlan *plan);
+static bool build_fd_plan(Command *cmd, int in_fd, int out_fd, FdPlan *plan);
+static void release_fd_plan(FdPlan *plan);
+static int copy_fd(int in_fd, int out_fd);
+static int compare_strings(const void *a, const void *b);
+static int builtin_cat(Command *cmd);
+static const char *lookup_command(const char *name);
+static void path_cache_clear(void);
+static void path_cache_forget(const char *name);
+static int builtin_cd(Command *cmd);
+static int builtin_echo(Command *cmd);
+static int builtin_exit(Command *cmd);
+static int builtin_export(Command *cmd);
+static int builtin_false(Command *cmd);
+static int builtin_fds(Command *cmd);
+static int builtin_hash(Command *cmd);
+static int builtin_help(Command *cmd);
+static int builtin_history(Command *cmd);
+static int builtin_limit(Command *cmd);
+static bool open_limit_cgroup(const char *name, const char *cpu_max,
+                              const char *memory_max, ChildLimits *limits);
+static int builtin_parallel(Command *cmd);
+static int builtin_printf(Command *cmd);
+static int builtin_pwd(Command *cmd);
+static int builtin_set(Command *cmd);
+static int builtin_test(Command *cmd);
+static int builtin_time(Command *cmd);
+static int builtin_true(Command *cmd);
+static int builtin_unset(Command *cmd);
+static int execute_timed(Pipeline *pipeline);
+static int execute_traced(Pipeline *pipeline);
+static bool trace_start(const char *path);
+static void trace_stop(void);
+static void trace_after_fork(void);
+static void *trace_writer(void *arg);
+static uint64_t monotonic_ns(void);
+static void out_write(const char *data, size_t len);
+static void out_putc(char c);
+static void out_printf(const char *fmt, ...);
+static void out_flush(void);
+static void flush_output(void);
+static void select_spawn_backend(void);
+static int highest_open_fd(void);
+static int child_fd_floor(const FdPlan *plan);
+static int exec_failure_status(int err);
+static void report_exec_failure(const char *name, int err);
+static void child_exec(const char *path, char **args, char **envp, int report_fd);
+static void child_fail(int report_fd, ChildStep step, int err);
+static void await_child_exec(const char *name, int report_fd);
+static void setup_signal_handlers(bool interactive);
 static void sigchld_handler(int signo);
+static bool event_add(int fd, short events, EventHandler handler, void *data);
+static void event_wait_readable(int fd);
+static Job *job_add(Pipeline *pipeline, const pid_t *pids, int count);
+static void reap_jobs(void);
+static bool jobs_finished(void);
+static void notify_jobs(void);
+static int builtin_jobs(Command *cmd);
+static int builtin_wait(Command *cmd);
+static int builtin_xargs(Command *cmd);
+static int run_commands(InputSource *input, bool interactive);
+static int run_server(const char *path);
+
+// Self-pipe written by the SIGCHLD handler and drained by reap_jobs().
+static int sigchld_pipe[2] = { -1, -1 };
+
+// True when reading commands from a terminal; controls job notices.
+static bool shell_interactive;
+
+// True when the prompt is drawn (interactive, with stdout on a terminal).
+static bool prompt_enabled;
+
+// Sources multiplexed with the input: SIGCHLD wakeups, control sockets.
+static EventLoop event_loop;
+
+// Serving one --server client: every line gets a status frame back.
+static bool server_client;
+
+// Background jobs launched with '&'.
+static JobTable job_table;
+
+// One past the highest descriptor the shell inherited; everything from
+// here up is shell-internal and must not reach children. -1 if unknown.
+static int inherited_fd_end = -1;
+
+// Backend used by execute_external().
+static SpawnBackend spawn_backend = DEFAULT_SPAWN_BACKEND;
+
+// Status for a stage whose launch started nothing: 127 when there was no
+// command to run, 126 when the file could not be executed.
+static int launch_status = 127;
+
+// Launch overhead and child resource totals.
+static ShellCounters shell_counters;
+
+// Time spent in parse_line() for the line being executed.
+static uint64_t last_parse_ns;
+
+// set -o timing: report every command as if prefixed with time.
+static bool option_timing;
+
+// set -o trace=FILE (or MYSHELL_TRACE=FILE): record every command.
+static TraceRing trace_ring = { .fd = -1 };
+
+static const ShellOption shell_options[] = {
+    { "timing", &option_timing, "Report time and resources after every command" },
+    { "trace",  &trace_ring.enabled, "Record every command to a trace file (trace=FILE)" },
+};
+
+// Shell variables and the cached environment for children. Filled from
+// environ on first use; until then children get environ as it is.
+static VarStore var_store;
+static bool vars_ready;
+
+// --startup-trace: time each init phase (and each lazy one) on stderr.
+static bool startup_trace;
+static uint64_t startup_begin_ns;
+static uint64_t startup_last_ns;
+
+// Status of the last pipeline run, for $?.
+static int last_status;
+
+// Per-line scratch: parse trees of uncached lines, expanded words and
+// layered environments. Reset by the main loop before each line.
+static Arena line_arena;
+
+// Match storage for glob threads other than the main one, reset with
+// line_arena.
+static Arena glob_arenas[GLOB_MAX_THREADS];
+
+// Listings of globbed directories.
+static DirCache dir_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Trees of previously parsed lines, reused when a script repeats itself.
+static ParseCache parse_cache;
+
+// PATH lookup cache shared by all external launches.
+static PathCache path_cache;
+
+// Character classes for the lexer (and the editor's word splitting);
+// bytes with class 0 are plain word characters, so a word run is one
+// table load per byte.
+static const unsigned char char_class[256] = {
+    ['\0'] = CC_END,
+    [' '] = CC_BLANK, ['\t'] = CC_BLANK, ['\r'] = CC_BLANK, ['\n'] = CC_BLANK,
+    ['|'] = CC_OPERATOR, ['&'] = CC_OPERATOR, [';'] = CC_OPERATOR,
+    ['<'] = CC_OPERATOR, ['>'] = CC_OPERATOR,
+    ['\''] = CC_QUOTE, ['"'] = CC_QUOTE, ['\\'] = CC_QUOTE,
+    ['$'] = CC_DOLLAR,
+    ['*'] = CC_GLOB, ['?'] = CC_GLOB, ['['] = CC_GLOB,
+};
+
+// Command history, opened on first use.
+static History history;
+
+// Line editor used when the prompt is drawn on a terminal.
+static LineEditor line_editor;
+
+// Command names offered by Tab completion.
+static CompletionTable completion;
+
+// CPUs and NUMA nodes for placement, loaded on first use.
+static CpuTopology cpu_topo;
+
+// Set in the child that runs a builtin pipeline stage.
+static bool in_stage_child;
+
+// Builtins compiled into the shell; registered on first lookup.
+static const BuiltinDef core_builtins[] = {
+    { "[",      builtin_test,   "[ expr ]",     "Evaluate a test expression" },
+    { "cat",    builtin_cat,    "cat [file..]", "Copy files (or stdin) to stdout" },
+    { "cd",     builtin_cd,     "cd [dir]",     "Change directory" },
+    { "echo",   builtin_echo,   "echo [-neE]",  "Write arguments to stdout" },
+    { "exit",   builtin_exit,   "exit [code]",  "Exit shell" },
+    { "export", builtin_export, "export [n=v]", "Set and export variables, or list them" },
+    { "false",  builtin_false,  "false",        "Return failure" },
+    { "fds",    builtin_fds,    "fds",          "List the shell's open descriptors" },
+    { "hash",   builtin_hash,   "hash [-r]",    "Show or reset the command path cache" },
+    { "help",   builtin_help,   "help",         "Display this help" },
+    { "history", builtin_history, "history [-s s]", "List or search command history" },
+    { "jobs",   builtin_jobs,   "jobs [-lp]",   "List background jobs" },
+    { "limit",  builtin_limit,  "limit [-vntgcN] cmd", "Run a command with limits or CPU placement" },
+    { "parallel", builtin_parallel, "parallel ...", "Run a command per item, N at a time" },
+    { "printf", builtin_printf, "printf fmt..", "Format and print arguments" },
+    { "pwd",    builtin_pwd,    "pwd",          "Print working directory" },
+    { "set",    builtin_set,    "set [+-]o opt", "Show or change shell options" },
+    { "test",   builtin_test,   "test expr",    "Evaluate a test expression" },
+    { "time",   builtin_time,   "time command", "Report time and resources used" },
+    { "true",   builtin_true,   "true",         "Return success" },
+    { "unset",  builtin_unset,  "unset name..", "Remove variables" },
+    { "wait",   builtin_wait,   "wait [%n|pid]", "Wait for background jobs" },
+    { "xargs",  builtin_xargs,  "xargs [-0nPs] cmd", "Run a command on stdin items, packed to ARG_MAX" },
+};
+
+// Registered builtins in registration order, plus an open-addressing
+// index over them so dispatch is one hash and one strcmp.
+static const BuiltinDef *builtin_registry[MAX_BUILTINS];
+static size_t builtin_count;
+static const BuiltinDef *builtin_index[BUILTIN_INDEX_SIZE];
+static bool builtins_ready;
+
+// Output of in-process builtins; goes to whatever fd 1 currently is.
+static OutBuffer out_buf;
+
+// Working directory as last set by startup or cd, and the prompt for it.
+static char *shell_cwd;
+static char *prompt_text;
+static size_t prompt_len;
+
+/*
+ * Get the working directory in a buffer that grows to fit any path
+ * Returns: Shared buffer overwritten by the next call, NULL on error
+ */
+static const char *current_directory(void) {
+    static char *cwd;
+    static size_t cwd_size;
+
+    if (cwd == NULL) {
+        cwd_size = INITIAL_CWD_SIZE;
+        cwd = malloc(cwd_size);
+        if (cwd == NULL) {
+            return NULL;
+        }
+    }
+
+    while (getcwd(cwd, cwd_size) == NULL) {
+        if (errno != ERANGE) {
+            return NULL;
+        }
+        char *grown = realloc(cwd, cwd_size * 2);
+        if (grown == NULL) {
+            return NULL;
+        }
+        cwd = grown;
+        cwd_size *= 2;
+    }
+    return cwd;
+}
+
+/*
+ * Record a new working directory and rebuild the prompt for it
+ * dir is NULL when it could not be determined; the prompt then falls
+ * back to "shell $".
+ */
+static void set_shell_cwd(const char *dir) {
+    char *copy = dir != NULL ? strdup(dir) : NULL;
+    free(shell_cwd);
+    shell_cwd = copy;
+    if (shell_cwd != NULL) {
+        var_set("PWD", shell_cwd, true);
+    }
+
+    const char *shown = shell_cwd != NULL ? shell_cwd : "shell";
+    size_t len = strlen(COLOR_PROMPT) + strlen(shown) + strlen(" $ " COLOR_RESET);
+    char *text = malloc(len + 1);
+    if (text == NULL) {
+        perror("malloc");
+        return;
+    }
+    snprintf(text, len + 1, COLOR_PROMPT "%s $ " COLOR_RESET, shown);
+
+    free(prompt_text);
+    prompt_text = text;
+    prompt_len = len;
+}
+
+/*
+ * Initialise the cached working directory at startup
+ * An inherited $PWD naming the same directory as "." is trusted, which
+ * keeps the logical path (through symlinks) and avoids getcwd().
+ */
+static void init_shell_cwd(void) {
+    const char *pwd = var_get("PWD");
+    struct stat pwd_st;
+    struct stat dot_st;
+
+    if (pwd != NULL && pwd[0] == '/' && stat(pwd, &pwd_st) == 0
+        && stat(".", &dot_st) == 0
+        && pwd_st.st_dev == dot_st.st_dev && pwd_st.st_ino == dot_st.st_ino) {
+        set_shell_cwd(pwd);
+    } else {
+        set_shell_cwd(current_directory());
+    }
+}
+
+/*
+ * Display shell prompt with current directory
+ * The text is rebuilt only when the directory changes; it is queued
+ * behind pending notices so the caller's flush emits both in one write().
+ */
+static void display_prompt(void) {
+    if (prompt_text != NULL) {
+        out_write(prompt_text, prompt_len);
+    }
+}
+
+/*
+ * Use an in-memory string (the -c argument) as the input source
+ */
+static bool input_open_string(InputSource *in, char *text) {
+    memset(in, 0, sizeof(*in));
+    in->buf = text;
+    in->len = strlen(text);
+    in->fd = -1;
+    in->eof = true;
+    return true;
+}
+
+/*
+ * Use a descriptor as the input source, read in INPUT_BLOCK_SIZE blocks
+ */
+static bool input_open_fd(InputSource *in, int fd) {
+    memset(in, 0, sizeof(*in));
+    in->buf = malloc(INPUT_BLOCK_SIZE);
+    if (in->buf == NULL) {
+        perror("malloc");
+        return false;
+    }
+    in->cap = INPUT_BLOCK_SIZE;
+    in->fd = fd;
+    in->keep = SIZE_MAX;
+    return true;
+}
+
+/*
+ * Open a script file, mapping it whole when it is a regular file
+ */
+static bool input_open_file(InputSource *in, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, COLOR_ERROR "%s: %s\n" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // MAP_PRIVATE + PROT_WRITE lets lines be NUL-terminated in place.
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            memset(in, 0, sizeof(*in));
+            in->buf = map;
+            in->len = (size_t)st.st_size;
+            in->map_len = (size_t)st.st_size;
+            in->fd = -1;
+            in->eof = true;
+            posix_madvise(map, in->map_len, POSIX_MADV_SEQUENTIAL);
+            return true;
+        }
+    }
+
+    // Pipes, FIFOs and empty files fall back to block reads.
+    if (!input_open_fd(in, fd)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Refill a block buffer, keeping any partial line at the front
+ * Returns: false once the descriptor reaches EOF or fails
+ */
+static bool input_fill(InputSource *in) {
+    // Records before pos are consumed unless a caller still holds them.
+    size_t from = in->keep < in->pos ? in->keep : in->pos;
+    if (from > 0) {
+        memmove(in->buf, in->buf + from, in->len - from);
+        in->len -= from;
+        in->pos -= from;
+        if (in->keep != SIZE_MAX) {
+            in->keep -= from;
+        }
+    }
+
+    // Keep one spare byte so the final line can always be terminated.
+    if (in->cap - in->len < 2) {
+        char *grown = realloc(in->buf, in->cap * 2);
+        if (grown == NULL) {
+            perror("realloc");
+            in->eof = true;
+            return false;
+        }
+        in->buf = grown;
+        in->cap *= 2;
+    }
+
+    // Job completions and other events are handled while we wait.
+    event_wait_readable(in->fd);
+
+    ssize_t n;
+    do {
+        n = read(in->fd, in->buf + in->len, in->cap - in->len - 1);
+    } while (n == -1 && errno == EINTR);
+
+    if (n <= 0) {
+        if (n < 0) {
+            perror("read");
+        }
+        in->eof = true;
+        return false;
+    }
+    in->len += (size_t)n;
+    return true;
+}
+
+/*
+ * Return the next line from the input source, without its newline
+ * Returns: Pointer into the source's buffer, valid until the next call,
+ *          or NULL at end of input
+ */
+static char *input_next_line(InputSource *in) {
+    return input_next_record(in, '\n');
+}
+
+/*
+ * Return the next sep-terminated record, NUL-terminated in place
+ * Records from in->keep on survive later calls; they may move with the
+ * buffer, but stay at the same offset from in->buf + in->keep.
+ * Returns: Pointer into the source's buffer, or NULL at end of input
+ */
+static char *input_next_record(InputSource *in, char sep) {
+    while (true) {
+        char *start = in->buf + in->pos;
+        size_t avail = in->len - in->pos;
+        char *newline = memchr(start, sep, avail);
+
+        if (newline != NULL) {
+            *newline = '\0';
+            in->pos = (size_t)(newline - in->buf) + 1;
+            return start;
+        }
+
+        if (in->eof || !input_fill(in)) {
+            break;
+        }
+    }
+
+    // Final line without a trailing newline.
+    size_t avail = in->len - in->pos;
+    if (avail == 0) {
+        return NULL;
+    }
+
+    char *start = in->buf + in->pos;
+    in->pos = in->len;
+    if (in->map_len > 0) {
+        // Writing past the mapping could fault; copy the tail instead.
+        free(in->tail);
+        in->tail = strndup(start, avail);
+        if (in->tail == NULL) {
+            perror("strndup");
+        }
+        return in->tail;
+    }
+    start[avail] = '\0';
+    return start;
+}
+
+/*
+ * Release whatever the input source owns
+ */
+static void input_close(InputSource *in) {
+    if (in->map_len > 0) {
+        munmap(in->buf, in->map_len);
+    } else if (in->cap > 0) {
+        free(in->buf);
+    }
+    if (in->fd > STDERR_FILENO) {
+        close(in->fd);
+    }
+    free(in->tail);
+    memset(in, 0, sizeof(*in));
+}
+
+/*
+ * Open and map the history file on first use
+ * $HISTFILE names it (empty disables history), else ~/.myshell_history.
+ * Returns: false if history is unavailable
+ */
+static bool history_init(void) {
+    if (history.ready) {
+        return history.fd >= 0;
+    }
+    history.ready = true;
+    history.fd = -1;
+
+    uint64_t start = startup_trace ? monotonic_ns() : 0;
+    const char *file = var_get("HISTFILE");
+    char *path = NULL;
+    if (file == NULL) {
+        const char *home = var_get("HOME");
+        if (home == NULL || asprintf(&path, "%s/.myshell_history", home) < 0) {
+            return false;
+        }
+        file = path;
+    }
+    if (file[0] != '\0') {
+        history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (history.fd < 0) {
+            fprintf(stderr, COLOR_ERROR "history: %s: %s\n" COLOR_RESET, file, strerror(errno));
+        }
+    }
+    free(path);
+    if (history.fd < 0) {
+        return false;
+    }
+
+    history.offsets = malloc(HISTORY_INITIAL_CAP * sizeof(size_t));
+    if (history.offsets == NULL) {
+        perror("malloc");
+        close(history.fd);
+        history.fd = -1;
+        return false;
+    }
+    history.cap = HISTORY_INITIAL_CAP;
+    history.offsets[0] = 0;
+    history_refresh();
+    startup_lazy("history", start);
+    return true;
+}
+
+/*
+ * Pick up records appended since the last look, by this shell or others
+ * The file only grows, so existing offsets stay valid; the mapping is
+ * simply replaced by a longer one. A partial record at the end (another
+ * shell mid-write) is left for next time.
+ */
+static void history_refresh(void) {
+    struct stat st;
+    if (fstat(history.fd, &st) != 0 || (size_t)st.st_size == history.map_len) {
+        return;
+    }
+
+    if ((size_t)st.st_size < history.map_len) {
+        // Truncated behind our back: start over.
+        history.count = 0;
+        history.offsets[0] = 0;
+        trigram_index_clear(&history.trigrams);
+    }
+    if (history.map != NULL) {
+        munmap(history.map, history.map_len);
+        history.map = NULL;
+        history.map_len = 0;
+    }
+    if (st.st_size == 0) {
+        return;
+    }
+    char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("history: mmap");
+        return;
+    }
+    history.map = map;
+    history.map_len = (size_t)st.st_size;
+
+    const char *p = map + history.offsets[history.count];
+    const char *end = map + history.map_len;
+    const char *nl;
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        if (history.count + 2 > history.cap) {
+            size_t *grown = realloc(history.offsets, history.cap * 2 * sizeof(size_t));
+            if (grown == NULL) {
+                perror("realloc");
+                return;
+            }
+            history.offsets = grown;
+            history.cap *= 2;
+        }
+        p = nl + 1;
+        history.offsets[++history.count] = (size_t)(p - map);
+    }
+}
+
+/*
+ * Text of history entry i (without its newline)
+ */
+static const char *history_entry(size_t i, size_t *len) {
+    *len = history.offsets[i + 1] - history.offsets[i] - 1;
+    return history.map + history.offsets[i];
+}
+
+/*
+ * Append a line to the history file
+ * A repeat of the newest entry is not recorded again.
+ */
+static void history_add(const char *line) {
+    size_t len = strlen(line);
+    if (len == 0 || !history_init()) {
+        return;
+    }
+
+    history_refresh();
+    if (history.count > 0) {
+        size_t last_len;
+        const char *last = history_entry(history.count - 1, &last_len);
+        if (last_len == len && memcmp(last, line, len) == 0) {
+            return;
+        }
+    }
+
+    char *record = malloc(len + 1);
+    if (record == NULL) {
+        return;
+    }
+    memcpy(record, line, len);
+    record[len] = '\n';
+    // One write() per record: O_APPEND keeps it whole against other shells.
+    if (write(history.fd, record, len + 1) != (ssize_t)(len + 1)) {
+        perror("history");
+    }
+    free(record);
+    history_refresh();
+}
+
+/*
+ * Pack three bytes into a trigram index key
+ */
+static uint32_t trigram_key(const char *p) {
+    return ((uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8
+            | (uint32_t)(unsigned char)p[2]) + 1;
+}
+
+/*
+ * Find the slot for key: its posting list, or the empty slot to put it in
+ */
+static TrigramPosting *trigram_slot(TrigramIndex *index, uint32_t key) {
+    size_t mask = index->cap - 1;
+    size_t i = (key * 2654435761u) & mask;
+    while (index->slots[i].key != 0 && index->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &index->slots[i];
+}
+
+/*
+ * Double the trigram table, rehashing every posting list
+ */
+static bool trigram_grow(TrigramIndex *index) {
+    TrigramIndex grown = *index;
+    grown.cap = index->cap > 0 ? index->cap * 2 : TRIGRAM_INITIAL_SLOTS;
+    grown.slots = calloc(grown.cap, sizeof(TrigramPosting));
+    if (grown.slots == NULL) {
+        perror("calloc");
+        return false;
+    }
+    for (size_t i = 0; i < index->cap; i++) {
+        if (index->slots[i].key != 0) {
+            *trigram_slot(&grown, index->slots[i].key) = index->slots[i];
+        }
+    }
+    free(index->slots);
+    *index = grown;
+    return true;
+}
+
+/*
+ * Record that entry id contains the trigram at p
+ */
+static bool trigram_add(TrigramIndex *index, const char *p, uint32_t id) {
+    if ((index->used + 1) * 4 > index->cap * 3 && !trigram_grow(index)) {
+        return false;
+    }
+
+    TrigramPosting *posting = trigram_slot(index, trigram_key(p));
+    if (posting->key == 0) {
+        posting->key = trigram_key(p);
+        index->used++;
+    } else if (posting->ids[posting->count - 1] == id) {
+        return true;        // Repeated within the same entry
+    }
+
+    if (posting->count == posting->cap) {
+        uint32_t cap = posting->cap > 0 ? posting->cap * 2 : 4;
+        uint32_t *ids = realloc(posting->ids, cap * sizeof(uint32_t));
+        if (ids == NULL) {
+            perror("realloc");
+            return false;
+        }
+        posting->ids = ids;
+        posting->cap = cap;
+    }
+    posting->ids[posting->count++] = id;
+    return true;
+}
+
+/*
+ * Drop every posting list
+ */
+static void trigram_index_clear(TrigramIndex *index) {
+    for (size_t i = 0; i < index->cap; i++) {
+        free(index->slots[i].ids);
+    }
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Index history entries added since the last search
+ */
+static void trigram_index_update(TrigramIndex *index) {
+    for (; index->indexed < history.count; index->indexed++) {
+        size_t len;
+        const char *text = history_entry(index->indexed, &len);
+        for (size_t j = 0; j + 3 <= len; j++) {
+            if (!trigram_add(index, text + j, (uint32_t)index->indexed)) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Find the newest history entry before entry `before` containing needle
+ * Needles of three or more bytes only visit entries on the posting list
+ * of their rarest trigram; shorter ones scan backwards.
+ * Returns: entry number, or -1 if none matches
+ */
+static long history_search(const char *needle, long before) {
+    size_t nlen = strlen(needle);
+    if (!history_init()) {
+        return -1;
+    }
+    history_refresh();
+    if (before < 0 || (size_t)before > history.count) {
+        before = (long)history.count;
+    }
+
+    if (nlen < 3) {
+        for (long i = before - 1; i >= 0; i--) {
+            size_t len;
+            const char *text = history_entry((size_t)i, &len);
+            if (memmem(text, len, needle, nlen) != NULL) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    TrigramIndex *index = &history.trigrams;
+    trigram_index_update(index);
+    if (index->cap == 0 || index->indexed < history.count) {
+        return -1;
+    }
+
+    const TrigramPosting *rarest = NULL;
+    for (size_t j = 0; j + 3 <= nlen; j++) {
+        const TrigramPosting *posting = trigram_slot(index, trigram_key(needle + j));
+        if (posting->key == 0) {
+            return -1;
+        }
+        if (rarest == NULL || posting->count < rarest->count) {
+            rarest = posting;
+        }
+    }
+
+    // Newest candidate older than before, then verify downwards.
+    size_t lo = 0;
+    size_t hi = rarest->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (rarest->ids[mid] < (uint32_t)before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    while (lo-- > 0) {
+        size_t len;
+        const char *text = history_entry(rarest->ids[lo], &len);
+        if (memmem(text, len, needle, nlen) != NULL) {
+            return (long)rarest->ids[lo];
+        }
+    }
+    return -1;
+}
+
+/*
+ * Collect the executables of one PATH directory from its cached listing
+ * Runs on the builder thread as well as the main one.
+ */
+static void completion_scan_dir(CompletionDir *dir) {
+    free(dir->names);
+    free(dir->blob);
+    dir->names = NULL;
+    dir->blob = NULL;
+    dir->count = 0;
+
+    DirListing *listing = dir_listing(dir->path);
+    if (listing == NULL) {
+        dir->missing = true;
+        return;
+    }
+    dir->missing = false;
+    dir->dev = listing->dev;
+    dir->ino = listing->ino;
+    dir->mtime = listing->mtime;
+    dir->trusted = listing->trusted;
+
+    dir->blob = malloc(listing->bytes + 1);
+    dir->names = malloc((listing->count + 1) * sizeof(char *));
+    if (dir->blob == NULL || dir->names == NULL) {
+        return;
+    }
+
+    size_t used = 0;
+    size_t dir_len = strlen(dir->path);
+    char path[PATH_MAX];
+    for (size_t i = 0; i < listing->count; i++) {
+        const char *name = listing->names[i];
+        unsigned char type = listing->types[i];
+        size_t len = strlen(name);
+        if (type == DT_DIR || dir_len + len + 2 > sizeof(path)) {
+            continue;
+        }
+
+        memcpy(path, dir->path, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, len + 1);
+        struct stat st;
+        if (type != DT_REG && (stat(path, &st) != 0 || !S_ISREG(st.st_mode))) {
+            continue;
+        }
+        if (access(path, X_OK) != 0) {
+            continue;
+        }
+
+        memcpy(dir->blob + used, name, len + 1);
+        dir->names[dir->count++] = dir->blob + used;
+        used += len + 1;
+    }
+}
+
+/*
+ * Rebuild the merged, sorted and deduplicated command name array
+ */
+static void completion_merge(CompletionTable *table) {
+    size_t total = builtin_count;
+    for (size_t i = 0; i < table->ndirs; i++) {
+        total += table->dirs[i].count;
+    }
+
+    const char **names = malloc((total + 1) * sizeof(char *));
+    if (names == NULL) {
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < builtin_count; i++) {
+        names[n++] = builtin_registry[i]->name;
+    }
+    for (size_t i = 0; i < table->ndirs; i++) {
+        for (size_t j = 0; j < table->dirs[i].count; j++) {
+            names[n++] = table->dirs[i].names[j];
+        }
+    }
+    qsort(names, n, sizeof(char *), compare_strings);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(names[unique - 1], names[i]) != 0) {
+            names[unique++] = names[i];
+        }
+    }
+
+    free(table->names);
+    table->names = names;
+    table->count = unique;
+}
+
+/*
+ * Builder thread: scan every PATH directory, then merge
+ */
+static void *completion_build(void *arg) {
+    CompletionTable *table = arg;
+    for (size_t i = 0; i < table->ndirs; i++) {
+        completion_scan_dir(&table->dirs[i]);
+    }
+    completion_merge(table);
+    return NULL;
+}
+
+/*
+ * Drop the command table
+ */
+static void completion_clear(CompletionTable *table) {
+    for (size_t i = 0; i < table->ndirs; i++) {
+        free(table->dirs[i].path);
+        free(table->dirs[i].names);
+        free(table->dirs[i].blob);
+    }
+    free(table->dirs);
+    free(table->names);
+    free(table->path_snapshot);
+    table->dirs = NULL;
+    table->ndirs = 0;
+    table->names = NULL;
+    table->count = 0;
+    table->path_snapshot = NULL;
+}
+
+/*
+ * Split $PATH into the table's directories (empty elements mean ".")
+ */
+static bool completion_set_path(CompletionTable *table, const char *path_var) {
+    completion_clear(table);
+    table->path_snapshot = strdup(path_var);
+    if (table->path_snapshot == NULL) {
+        return false;
+    }
+
+    size_t n = 1;
+    for (const char *p = path_var; *p; p++) {
+        n += *p == ':';
+    }
+    table->dirs = calloc(n, sizeof(CompletionDir));
+    if (table->dirs == NULL) {
+        return false;
+    }
+    for (const char *p = path_var; ; ) {
+        const char *colon = strchrnul(p, ':');
+        table->dirs[table->ndirs++].path = colon > p ? strndup(p, (size_t)(colon - p))
+                                                     : strdup(".");
+        if (table->dirs[table->ndirs - 1].path == NULL) {
+            table->ndirs--;
+        }
+        if (*colon == '\0') {
+            break;
+        }
+        p = colon + 1;
+    }
+    return true;
+}
+
+/*
+ * Start building the command table in the background
+ * Called when the line editor first opens, so the table is usually
+ * complete by the time the user presses Tab. The directory cache is
+ * pinned while the builder runs so its listings are not freed under it.
+ */
+static void completion_start(void) {
+    CompletionTable *table = &completion;
+    if (table->path_snapshot != NULL || table->building) {
+        return;
+    }
+
+    const char *path_var = var_get("PATH");
+    find_builtin("");       // Registers the builtins the table includes
+    if (!completion_set_path(table, path_var != NULL ? path_var : DEFAULT_PATH)) {
+        return;
+    }
+
+    atomic_fetch_add(&dir_cache.pinned, 1);
+    if (pthread_create(&table->builder, NULL, completion_build, table) == 0) {
+        table->building = true;
+    } else {
+        completion_build(table);
+        atomic_fetch_sub(&dir_cache.pinned, 1);
+    }
+}
+
+/*
+ * Get the command table up to date for a lookup
+ * Waits for the builder if it is still running, then rescans only the
+ * PATH directories whose (dev, inode, mtime) changed; a new $PATH
+ * rebuilds everything.
+ */
+static CompletionTable *completion_commands(void) {
+    CompletionTable *table = &completion;
+    completion_start();
+    if (table->building) {
+        pthread_join(table->builder, NULL);
+        table->building = false;
+        atomic_fetch_sub(&dir_cache.pinned, 1);
+    }
+
+    const char *path_var = var_get("PATH");
+    if (path_var == NULL) {
+        path_var = DEFAULT_PATH;
+    }
+    if (table->path_snapshot == NULL || strcmp(table->path_snapshot, path_var) != 0) {
+        if (completion_set_path(table, path_var)) {
+            completion_build(table);
+        }
+        return table;
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < table->ndirs; i++) {
+        CompletionDir *dir = &table->dirs[i];
+        struct stat st;
+        bool present = stat(dir->path, &st) == 0;
+        if (present != !dir->missing || (present && (!dir->trusted || st.st_dev != dir->dev
+                || st.st_ino != dir->ino || st.st_mtim.tv_sec != dir->mtime.tv_sec
+                || st.st_mtim.tv_nsec != dir->mtime.tv_nsec))) {
+            completion_scan_dir(dir);
+            changed = true;
+        }
+    }
+    if (changed) {
+        completion_merge(table);
+    }
+    return table;
+}
+
+/*
+ * Add a completion candidate, growing the array as needed
+ */
+static bool completion_add(Completion *list, const char *name, bool is_dir) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 64;
+        CompletionMatch *grown = realloc(list->matches, cap * sizeof(CompletionMatch));
+        if (grown == NULL) {
+            return false;
+        }
+        list->matches = grown;
+        list->cap = cap;
+    }
+    list->matches[list->count++] = (CompletionMatch){ .name = name, .is_dir = is_dir };
+    return true;
+}
+
+/*
+ * Commands starting with prefix, by binary search in the sorted table
+ */
+static void complete_command(Completion *list, const char *prefix, size_t len) {
+    CompletionTable *table = completion_commands();
+    size_t lo = 0;
+    size_t hi = table->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(table->names[mid], prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < table->count && strncmp(table->names[lo], prefix, len) == 0; lo++) {
+        if (!completion_add(list, table->names[lo], false)) {
+            return;
+        }
+    }
+}
+
+/*
+ * File names matching word, from the cached listing of its directory
+ * Hidden names only match a prefix that starts with '.'.
+ */
+static void complete_file(Completion *list, const char *word, size_t len) {
+    const char *slash = memrchr(word, '/', len);
+    const char *base = slash != NULL ? slash + 1 : word;
+    size_t base_len = len - (size_t)(base - word);
+    char dir_path[PATH_MAX];
+
+    if (slash == NULL) {
+        strcpy(dir_path, ".");
+    } else if (slash == word) {
+        strcpy(dir_path, "/");
+    } else if ((size_t)(slash - word) < sizeof(dir_path)) {
+        memcpy(dir_path, word, (size_t)(slash - word));
+        dir_path[slash - word] = '\0';
+    } else {
+        return;
+    }
+
+    DirListing *listing = dir_listing(dir_path);
+    if (listing == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < listing->count; i++) {
+        const char *name = listing->names[i];
+        if (strncmp(name, base, base_len) != 0 || (name[0] == '.' && base[0] != '.')) {
+            continue;
+        }
+
+        bool is_dir = listing->types[i] == DT_DIR;
+        if (listing->types[i] == DT_LNK || listing->types[i] == DT_UNKNOWN) {
+            char path[PATH_MAX];
+            struct stat st;
+            if (snprintf(path, sizeof(path), "%s/%s", dir_path, name) < (int)sizeof(path)) {
+                is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+            }
+        }
+        if (!completion_add(list, name, is_dir)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Order candidates by name for display and prefix computation
+ */
+static int compare_matches(const void *a, const void *b) {
+    return strcmp(((const CompletionMatch *)a)->name, ((const CompletionMatch *)b)->name);
+}
+
+/*
+ * Columns a byte range occupies; UTF-8 continuation bytes take none and
+ * colour escapes ("\033[...m") are skipped
+ */
+static size_t editor_width(const char *text, size_t len) {
+    size_t cols = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\033' && i + 1 < len && text[i + 1] == '[') {
+            for (i += 2; i < len && text[i] != 'm'; i++) {
+            }
+        } else if (((unsigned char)text[i] & 0xC0) != 0x80) {
+            cols++;
+        }
+    }
+    return cols;
+}
+
+/*
+ * Queue bytes for the terminal; everything goes out in editor_flush()
+ */
+static void editor_out(const char *data, size_t len) {
+    LineEditor *ed = &line_editor;
+    if (ed->out_len + len > ed->out_cap) {
+        size_t cap = ed->out_cap > 0 ? ed->out_cap : EDITOR_OUT_SIZE;
+        while (cap < ed->out_len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(ed->out, cap);
+        if (grown == NULL) {
+            return;
+        }
+        ed->out = grown;
+        ed->out_cap = cap;
+    }
+    memcpy(ed->out + ed->out_len, data, len);
+    ed->out_len += len;
+}
+
+/*
+ * Queue a cursor-control sequence
+ */
+static void editor_outf(const char *fmt, ...) {
+    char seq[32];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(seq, sizeof(seq), fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        editor_out(seq, (size_t)n < sizeof(seq) ? (size_t)n : sizeof(seq) - 1);
+    }
+}
+
+/*
+ * Send everything queued since the last flush in one write()
+ */
+static void editor_flush(void) {
+    LineEditor *ed = &line_editor;
+    size_t done = 0;
+    while (done < ed->out_len) {
+        ssize_t n = write(STDOUT_FILENO, ed->out + done, ed->out_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    ed->out_len = 0;
+}
+
+/*
+ * Screen column, counted from the prompt's first one, of buffer offset off
+ */
+static size_t editor_column(size_t off) {
+    return line_editor.prompt_cols + editor_width(line_editor.buf, off);
+}
+
+/*
+ * Move the terminal cursor to a screen column, across wrapped rows
+ */
+static void editor_move(size_t col) {
+    LineEditor *ed = &line_editor;
+    if (col == ed->term_col) {
+        return;
+    }
+    size_t from_row = ed->term_col / ed->cols;
+    size_t to_row = col / ed->cols;
+
+    if (from_row > to_row) {
+        editor_outf("\033[%zuA", from_row - to_row);
+    } else if (from_row < to_row) {
+        editor_outf("\033[%zuB", to_row - from_row);
+    }
+    editor_out("\r", 1);
+    if (col % ed->cols > 0) {
+        editor_outf("\033[%zuC", col % ed->cols);
+    }
+    ed->term_col = col;
+}
+
+/*
+ * Move the cursor to a buffer offset, redrawing nothing
+ */
+static void editor_goto(size_t off) {
+    editor_move(editor_column(off));
+    line_editor.cursor = off;
+}
+
+/*
+ * Bring the screen up to date when buf is unchanged before offset from
+ * Only the suffix is rewritten; leftovers of a longer old line are
+ * cleared.
+ */
+static void editor_refresh(size_t from) {
+    LineEditor *ed = &line_editor;
+    size_t cursor = ed->cursor;
+
+    editor_move(editor_column(from));
+    editor_out(ed->buf + from, ed->len - from);
+    ed->term_col = editor_column(ed->len);
+
+    // Text ending on the last column leaves the cursor pending a wrap.
+    if (ed->term_col > 0 && ed->term_col % ed->cols == 0) {
+        editor_out("\r\n", 2);
+    }
+    if (ed->term_col < ed->shown_cols) {
+        editor_out("\033[J", 3);
+    }
+    ed->shown_cols = ed->term_col;
+    if (cursor != ed->len) {
+        editor_goto(cursor);
+    }
+}
+
+/*
+ * Redraw the prompt and the whole line, e.g. after the prompt changed
+ */
+static void editor_redraw(void) {
+    LineEditor *ed = &line_editor;
+    size_t row = ed->term_col / ed->cols;
+
+    if (row > 0) {
+        editor_outf("\033[%zuA", row);
+    }
+    editor_out("\r", 1);
+    editor_out(ed->prompt, strlen(ed->prompt));
+    ed->term_col = ed->prompt_cols;
+    ed->shown_cols = SIZE_MAX;   // Unknown: clear whatever follows
+    editor_refresh(0);
+}
+
+/*
+ * Draw a fresh prompt and the line on the current (empty) row
+ */
+static void editor_draw(void) {
+    LineEditor *ed = &line_editor;
+    editor_out(ed->prompt, strlen(ed->prompt));
+    ed->term_col = ed->prompt_cols;
+    ed->shown_cols = 0;
+    editor_refresh(0);
+}
+
+/*
+ * Make room for len more bytes in the line
+ */
+static bool editor_reserve(size_t len) {
+    LineEditor *ed = &line_editor;
+    if (ed->len + len + 1 <= ed->cap) {
+        return true;
+    }
+    size_t cap = ed->cap > 0 ? ed->cap : EDITOR_LINE_SIZE;
+    while (cap < ed->len + len + 1) {
+        cap *= 2;
+    }
+    char *grown = realloc(ed->buf, cap);
+    if (grown == NULL) {
+        perror("realloc");
+        return false;
+    }
+    ed->buf = grown;
+    ed->cap = cap;
+    return true;
+}
+
+/*
+ * Insert bytes at the cursor; a pasted block is one insertion
+ */
+static void editor_insert(const char *text, size_t len) {
+    LineEditor *ed = &line_editor;
+    if (!editor_reserve(len)) {
+        return;
+    }
+    size_t at = ed->cursor;
+    memmove(ed->buf + at + len, ed->buf + at, ed->len - at + 1);
+    memcpy(ed->buf + at, text, len);
+    ed->len += len;
+    ed->cursor += len;
+    editor_refresh(at);
+}
+
+/*
+ * Remove buf[from, to) and leave the cursor at from
+ */
+static void editor_delete(size_t from, size_t to) {
+    LineEditor *ed = &line_editor;
+    if (from >= to) {
+        return;
+    }
+    memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+    ed->len -= to - from;
+    ed->cursor = from;
+    editor_refresh(from);
+}
+
+/*
+ * Replace the whole line, redrawing from the first byte that differs
+ */
+static void editor_replace(const char *text, size_t len, size_t cursor) {
+    LineEditor *ed = &line_editor;
+    size_t common = 0;
+    while (common < len && common < ed->len && ed->buf[common] == text[common]) {
+        common++;
+    }
+    if (!editor_reserve(len > ed->len ? len - ed->len : 0)) {
+        return;
+    }
+    memmove(ed->buf, text, len);
+    ed->buf[len] = '\0';
+    ed->len = len;
+    ed->cursor = cursor;
+    editor_refresh(common);
+}
+
+/*
+ * Offset of the character before / after off (UTF-8 aware)
+ */
+static size_t editor_prev(size_t off) {
+    const char *buf = line_editor.buf;
+    while (off > 0 && ((unsigned char)buf[--off] & 0xC0) == 0x80) {
+    }
+    return off;
+}
+
+static size_t editor_next(size_t off) {
+    const char *buf = line_editor.buf;
+    size_t len = line_editor.len;
+    if (off < len) {
+        off++;
+    }
+    while (off < len && ((unsigned char)buf[off] & 0xC0) == 0x80) {
+        off++;
+    }
+    return off;
+}
+
+/*
+ * Start of the word before the cursor, or the end of the one after it
+ */
+static size_t editor_word_left(size_t off) {
+    const char *buf = line_editor.buf;
+    while (off > 0 && buf[off - 1] == ' ') {
+        off--;
+    }
+    while (off > 0 && buf[off - 1] != ' ') {
+        off--;
+    }
+    return off;
+}
+
+static size_t editor_word_right(size_t off) {
+    const char *buf = line_editor.buf;
+    size_t len = line_editor.len;
+    while (off < len && buf[off] == ' ') {
+        off++;
+    }
+    while (off < len && buf[off] != ' ') {
+        off++;
+    }
+    return off;
+}
+
+/*
+ * Step through history: -1 for older, +1 for newer
+ * The line being typed is put aside and comes back past the newest entry.
+ */
+static void editor_history(int step) {
+    LineEditor *ed = &line_editor;
+    if (!history_init()) {
+        return;
+    }
+
+    if (ed->history_pos < 0) {
+        if (step > 0) {
+            return;
+        }
+        history_refresh();
+        if (history.count == 0) {
+            return;
+        }
+        free(ed->stash);
+        ed->stash = strndup(ed->buf, ed->len);
+        ed->history_pos = (long)history.count;
+    }
+
+    long pos = ed->history_pos + step;
+    if (pos < 0) {
+        return;
+    }
+    ed->history_pos = pos;
+    if ((size_t)pos >= history.count) {
+        const char *stash = ed->stash != NULL ? ed->stash : "";
+        editor_replace(stash, strlen(stash), strlen(stash));
+        ed->history_pos = -1;
+        return;
+    }
+    size_t len;
+    const char *text = history_entry((size_t)pos, &len);
+    editor_replace(text, len, len);
+}
+
+/*
+ * Show the reverse search prompt and its current match
+ */
+static void editor_search_show(bool failed) {
+    LineEditor *ed = &line_editor;
+
+    snprintf(ed->search_prompt, sizeof(ed->search_prompt), "(%sreverse-i-search)`%.*s': ",
+             failed ? "failed " : "", (int)ed->search_len, ed->search);
+    ed->prompt = ed->search_prompt;
+    ed->prompt_cols = editor_width(ed->prompt, strlen(ed->prompt));
+
+    if (ed->search_match >= 0) {
+        size_t len;
+        const char *text = history_entry((size_t)ed->search_match, &len);
+        const char *hit = memmem(text, len, ed->search, ed->search_len);
+        if (editor_reserve(len > ed->len ? len - ed->len : 0)) {
+            memcpy(ed->buf, text, len);
+            ed->buf[len] = '\0';
+            ed->len = len;
+            ed->cursor = hit != NULL ? (size_t)(hit - text) : 0;
+        }
+    }
+    editor_redraw();
+}
+
+/*
+ * Look for the query again: older than the current match when next is
+ * set, otherwise from the current match back
+ */
+static void editor_search_update(bool next) {
+    LineEditor *ed = &line_editor;
+    ed->search[ed->search_len] = '\0';
+
+    long before = ed->search_match < 0 ? -1 : ed->search_match + (next ? 0 : 1);
+    long found = ed->search_len > 0 ? history_search(ed->search, before) : -1;
+    if (found >= 0) {
+        ed->search_match = found;
+    }
+    editor_search_show(found < 0 && ed->search_len > 0);
+}
+
+/*
+ * Leave reverse search, keeping the match or (cancel) the original line
+ */
+static void editor_search_end(bool cancel) {
+    LineEditor *ed = &line_editor;
+
+    ed->searching = false;
+    ed->prompt = ed->shell_prompt;
+    ed->prompt_cols = editor_width(ed->prompt, strlen(ed->prompt));
+    if (cancel && ed->stash != NULL) {
+        size_t len = strlen(ed->stash);
+        if (editor_reserve(len > ed->len ? len - ed->len : 0)) {
+            memcpy(ed->buf, ed->stash, len + 1);
+            ed->len = len;
+            ed->cursor = len;
+        }
+    }
+    editor_redraw();
+}
+
+/*
+ * Handle one key during reverse search
+ * Returns: false if the key ends the search and must be handled normally
+ */
+static bool editor_search_key(unsigned char c) {
+    LineEditor *ed = &line_editor;
+
+    if (c == CTRL_KEY('R')) {
+        if (ed->search_len > 0) {
+            editor_search_update(true);
+        }
+    } else if (c == 0x7f || c == CTRL_KEY('H')) {
+        if (ed->search_len > 0) {
+            ed->search_len--;
+            ed->search_match = -1;
+            editor_search_update(false);
+        }
+    } else if (c == CTRL_KEY('G')) {
+        editor_search_end(true);
+    } else if (c >= 0x20 && ed->search_len + 1 < EDITOR_SEARCH_MAX) {
+        ed->search[ed->search_len++] = (char)c;
+        editor_search_update(false);
+    } else {
+        editor_search_end(false);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Wait for more input, flushing the screen first
+ * With timeout_ms >= 0 (a lone ESC) give up if nothing comes in time.
+ * Returns: false at end of input or on timeout
+ */
+static bool editor_wait(InputSource *in, int timeout_ms) {
+    editor_flush();
+    if (timeout_ms >= 0) {
+        struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return false;
+        }
+    }
+    return !in->eof && input_fill(in);
+}
+
+/*
+ * Decode an escape sequence at in->buf[in->pos] (the ESC) into a key
+ * Returns: EDITOR_KEY_ value, 0 for sequences that are ignored
+ */
+static int editor_escape(InputSource *in) {
+    // Let the rest of a sequence split across reads arrive.
+    while (in->len - in->pos < 2) {
+        if (!editor_wait(in, EDITOR_ESC_TIMEOUT_MS)) {
+            in->pos++;
+            return EDITOR_KEY_ESC;
+        }
+    }
+
+    char kind = in->buf[in->pos + 1];
+    if (kind != '[' && kind != 'O') {
+        in->pos += 2;
+        return kind == 'b' ? EDITOR_KEY_WORD_LEFT : kind == 'f' ? EDITOR_KEY_WORD_RIGHT : 0;
+    }
+
+    // CSI / SS3: parameter bytes, then one final byte in 0x40-0x7e.
+    // Offsets are relative: a refill moves the buffered bytes.
+    size_t i = 2;
+    while (true) {
+        while (in->pos + i >= in->len) {
+            if (!editor_wait(in, EDITOR_ESC_TIMEOUT_MS)) {
+                in->pos = in->len;
+                return 0;
+            }
+        }
+        char b = in->buf[in->pos + i];
+        if (b >= 0x40 && b <= 0x7e) {
+            break;
+        }
+        i++;
+    }
+
+    char final = in->buf[in->pos + i];
+    int param = atoi(in->buf + in->pos + 2);
+    in->pos += i + 1;
+
+    switch (final) {
+    case 'A': return EDITOR_KEY_UP;
+    case 'B': return EDITOR_KEY_DOWN;
+    case 'C': return EDITOR_KEY_RIGHT;
+    case 'D': return EDITOR_KEY_LEFT;
+    case 'H': return EDITOR_KEY_HOME;
+    case 'F': return EDITOR_KEY_END;
+    case '~':
+        return param == 1 || param == 7 ? EDITOR_KEY_HOME
+             : param == 4 || param == 8 ? EDITOR_KEY_END
+             : param == 3 ? EDITOR_KEY_DELETE : 0;
+    }
+    return 0;
+}
+
+/*
+ * Put the terminal in raw mode for editing, or back
+ */
+static bool editor_raw(bool on) {
+    LineEditor *ed = &line_editor;
+    if (!on) {
+        if (ed->raw) {
+            tcsetattr(STDIN_FILENO, TCSANOW, &ed->saved);
+            ed->raw = false;
+        }
+        return true;
+    }
+
+    // Taken afresh each line: a program may have changed the settings.
+    if (tcgetattr(STDIN_FILENO, &ed->saved) != 0) {
+        return false;
+    }
+    struct termios raw = ed->saved;
+    raw.c_iflag &= ~(tcflag_t)(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    // TCSANOW rather than TCSAFLUSH: type-ahead must survive.
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
+        return false;
+    }
+    ed->raw = true;
+    return true;
+}
+
+/*
+ * Whether the interactive shell can use the editor on this terminal
+ */
+static bool editor_available(void) {
+    LineEditor *ed = &line_editor;
+    if (ed->usable == 0) {
+        const char *term = var_get("TERM");
+        struct termios probe;
+        ed->usable = term != NULL && strcmp(term, "dumb") != 0
+                     && tcgetattr(STDIN_FILENO, &probe) == 0 ? 1 : -1;
+    }
+    return ed->usable > 0;
+}
+
+/*
+ * Queue text for the line, backslash-escaping characters the lexer
+ * would otherwise treat specially
+ */
+static void editor_insert_escaped(const char *text, size_t len, char terminator) {
+    char *escaped = malloc(len * 2 + 2);
+    if (escaped == NULL) {
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (char_class[c] != CC_WORD && char_class[c] != CC_END) {
+            escaped[n++] = '\\';
+        }
+        escaped[n++] = (char)c;
+    }
+    if (terminator != '\0') {
+        escaped[n++] = terminator;
+    }
+    editor_insert(escaped, n);
+    free(escaped);
+}
+
+/*
+ * Print the candidates in columns below the line, then redraw it
+ */
+static void editor_list_matches(const Completion *list) {
+    LineEditor *ed = &line_editor;
+    editor_goto(ed->len);
+    editor_out("\r\n", 2);
+
+    if (list->count > COMPLETION_LIST_MAX) {
+        editor_outf("(%zu matches)\r\n", list->count);
+    } else {
+        size_t width = 0;
+        for (size_t i = 0; i < list->count; i++) {
+            size_t len = strlen(list->matches[i].name) + list->matches[i].is_dir;
+            width = len > width ? len : width;
+        }
+        width += 2;
+        size_t per_row = ed->cols / width > 0 ? ed->cols / width : 1;
+        for (size_t i = 0; i < list->count; i++) {
+            const CompletionMatch *m = &list->matches[i];
+            size_t len = strlen(m->name);
+            editor_out(m->name, len);
+            if (m->is_dir) {
+                editor_out("/", 1);
+            }
+            if ((i + 1) % per_row == 0 || i + 1 == list->count) {
+                editor_out("\r\n", 2);
+            } else {
+                for (size_t pad = len + m->is_dir; pad < width; pad++) {
+                    editor_out(" ", 1);
+                }
+            }
+        }
+    }
+    editor_draw();
+}
+
+/*
+ * Tab: complete the word before the cursor
+ * The first word of a command completes against builtins and PATH
+ * executables, anything else (or a word with a '/') against file names.
+ * A unique match is finished with a space (or '/' for a directory);
+ * several are extended to their common prefix, and a second Tab lists
+ * them.
+ */
+static void editor_complete(bool again) {
+    LineEditor *ed = &line_editor;
+
+    // The word runs back to an unescaped blank or operator.
+    size_t start = ed->cursor;
+    while (start > 0) {
+        unsigned char c = (unsigned char)ed->buf[start - 1];
+        bool escaped = start > 1 && ed->buf[start - 2] == '\\';
+        if ((char_class[c] == CC_BLANK || char_class[c] == CC_OPERATOR) && !escaped) {
+            break;
+        }
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && char_class[(unsigned char)ed->buf[before - 1]] == CC_BLANK) {
+        before--;
+    }
+    bool command = before == 0 || char_class[(unsigned char)ed->buf[before - 1]] == CC_OPERATOR;
+
+    // Match against the word as the lexer would see it, quotes removed.
+    char word[PATH_MAX];
+    size_t len = 0;
+    for (size_t i = start; i < ed->cursor && len + 1 < sizeof(word); i++) {
+        char c = ed->buf[i];
+        if (c == '\\' && i + 1 < ed->cursor) {
+            word[len++] = ed->buf[++i];
+        } else if (c != '\'' && c != '"') {
+            word[len++] = c;
+        }
+    }
+    word[len] = '\0';
+
+    Completion list = { 0 };
+    if (command && memchr(word, '/', len) == NULL) {
+        complete_command(&list, word, len);
+    } else {
+        complete_file(&list, word, len);
+        qsort(list.matches, list.count, sizeof(CompletionMatch), compare_matches);
+    }
+
+    const char *base = memrchr(word, '/', len);
+    size_t base_len = base != NULL ? len - (size_t)(base + 1 - word) : len;
+
+    if (list.count == 0) {
+        editor_out("\a", 1);
+    } else if (list.count == 1) {
+        const CompletionMatch *m = &list.matches[0];
+        editor_insert_escaped(m->name + base_len, strlen(m->name) - base_len,
+                              m->is_dir ? '/' : ' ');
+    } else {
+        size_t common = strlen(list.matches[0].name);
+        for (size_t i = 1; i < list.count; i++) {
+            size_t j = base_len;
+            while (j < common && list.matches[i].name[j] == list.matches[0].name[j]) {
+                j++;
+            }
+            common = j;
+        }
+        if (common > base_len) {
+            editor_insert_escaped(list.matches[0].name + base_len, common - base_len, '\0');
+        } else if (again) {
+            editor_list_matches(&list);
+        } else {
+            editor_out("\a", 1);
+        }
+    }
+    free(list.matches);
+}
+
+/*
+ * Read a line from the terminal with editing
+ * Input is taken in blocks through the input source, so a paste reaches
+ * the line as a few large insertions; each block is answered with one
+ * write() that redraws only what changed.
+ * Returns: the line, valid until the next call; "" after Ctrl-C; NULL at
+ * end of input
+ */
+static char *editor_read_line(InputSource *in) {
+    LineEditor *ed = &line_editor;
+
+    if (!editor_raw(true) || !editor_reserve(0)) {
+        ed->usable = -1;
+        display_prompt();
+        out_flush();
+        return input_next_line(in);
+    }
+
+    struct winsize ws;
+    ed->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    ed->shell_prompt = prompt_text != NULL ? prompt_text : "$ ";
+    ed->prompt = ed->shell_prompt;
+    ed->prompt_cols = editor_width(ed->prompt, strlen(ed->prompt));
+    ed->len = 0;
+    ed->cursor = 0;
+    ed->buf[0] = '\0';
+    ed->history_pos = -1;
+    ed->searching = false;
+    free(ed->stash);
+    ed->stash = NULL;
+    ed->active = true;
+    editor_draw();
+    editor_flush();
+    completion_start();
+
+    bool eof = false;
+    bool tabbed = false;    // Last key was Tab: another one lists matches
+    while (true) {
+        if (in->pos == in->len && !editor_wait(in, -1)) {
+            // End of input: a partial line still runs, like a script's.
+            eof = ed->len == 0;
+            editor_out("\r\n", 2);
+            break;
+        }
+
+        unsigned char c = (unsigned char)in->buf[in->pos];
+        if (ed->searching && c != '\033' && c != '\r' && c != '\n') {
+            if (editor_search_key(c)) {
+                in->pos++;
+                continue;
+            }
+        }
+
+        if (c >= 0x20 && c != 0x7f) {
+            // Insert the whole run of plain bytes at once.
+            size_t start = in->pos;
+            while (in->pos < in->len && (unsigned char)in->buf[in->pos] >= 0x20
+                   && in->buf[in->pos] != 0x7f) {
+                in->pos++;
+            }
+            editor_insert(in->buf + start, in->pos - start);
+            tabbed = false;
+            continue;
+        }
+
+        int key = c;
+        bool again = tabbed;
+        tabbed = false;
+        if (c == '\033') {
+            key = editor_escape(in);
+            if (ed->searching) {
+                editor_search_end(key == EDITOR_KEY_ESC);
+            }
+        } else {
+            in->pos++;
+        }
+
+        if (key == '\r' || key == '\n') {
+            if (ed->searching) {
+                editor_search_end(false);
+            }
+            editor_goto(ed->len);
+            editor_out("\r\n", 2);
+            break;
+        }
+
+        switch (key) {
+        case '\t':
+            editor_complete(again);
+            tabbed = true;
+            break;
+        case CTRL_KEY('C'):
+            editor_goto(ed->len);
+            editor_out("^C\r\n", 4);
+            ed->len = 0;
+            ed->buf[0] = '\0';
+            ed->active = false;
+            editor_flush();
+            editor_raw(false);
+            return ed->buf;
+        case CTRL_KEY('D'):
+            if (ed->len == 0) {
+                eof = true;
+                editor_out("\r\n", 2);
+                goto done;
+            }
+            editor_delete(ed->cursor, editor_next(ed->cursor));
+            break;
+        case EDITOR_KEY_DELETE:
+            editor_delete(ed->cursor, editor_next(ed->cursor));
+            break;
+        case 0x7f:
+        case CTRL_KEY('H'):
+            editor_delete(editor_prev(ed->cursor), ed->cursor);
+            break;
+        case CTRL_KEY('A'):
+        case EDITOR_KEY_HOME:
+            editor_goto(0);
+            break;
+        case CTRL_KEY('E'):
+        case EDITOR_KEY_END:
+            editor_goto(ed->len);
+            break;
+        case CTRL_KEY('B'):
+        case EDITOR_KEY_LEFT:
+            editor_goto(editor_prev(ed->cursor));
+            break;
+        case CTRL_KEY('F'):
+        case EDITOR_KEY_RIGHT:
+            editor_goto(editor_next(ed->cursor));
+            break;
+        case EDITOR_KEY_WORD_LEFT:
+            editor_goto(editor_word_left(ed->cursor));
+            break;
+        case EDITOR_KEY_WORD_RIGHT:
+            editor_goto(editor_word_right(ed->cursor));
+            break;
+        case CTRL_KEY('P'):
+        case EDITOR_KEY_UP:
+            editor_history(-1);
+            break;
+        case CTRL_KEY('N'):
+        case EDITOR_KEY_DOWN:
+            editor_history(1);
+            break;
+        case CTRL_KEY('K'):
+            editor_delete(ed->cursor, ed->len);
+            break;
+        case CTRL_KEY('U'):
+            editor_delete(0, ed->cursor);
+            break;
+        case CTRL_KEY('W'):
+            editor_delete(editor_word_left(ed->cursor), ed->cursor);
+            break;
+        case CTRL_KEY('L'):
+            editor_out("\033[H\033[2J", 7);
+            editor_draw();
+            break;
+        case CTRL_KEY('R'):
+            if (history_init()) {
+                free(ed->stash);
+                ed->stash = strndup(ed->buf, ed->len);
+                ed->searching = true;
+                ed->history_pos = -1;
+                ed->search_len = 0;
+                ed->search_match = -1;
+                editor_search_show(false);
+            }
+            break;
+        }
+    }
+
+done:
+    ed->active = false;
+    editor_flush();
+    editor_raw(false);
+    return eof ? NULL : ed->buf;
+}
+
+/*
+ * Step off the line being edited so job notices can be printed
+ */
+static void editor_suspend(void) {
+    LineEditor *ed = &line_editor;
+    editor_goto(ed->len);
+    editor_refresh(ed->len);
+    editor_flush();
+}
+
+/*
+ * Draw the prompt and the line again below whatever was printed
+ */
+static void editor_resume(void) {
+    editor_draw();
+    editor_flush();
+}
+
+/*
+ * Allocate size bytes from the arena, suitably aligned for any type
+ * Returns: Zeroed memory valid until the next arena_reset(), or NULL
+ */
+static void *arena_alloc(Arena *arena, size_t size) {
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    ArenaChunk *chunk = arena->current;
+    while (chunk != NULL && chunk->size - chunk->used < size) {
+        chunk = chunk->next;
+    }
+
+    if (chunk == NULL) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+
+        // Append after the current chunk so earlier chunks stay in order.
+        if (arena->current == NULL) {
+            chunk->next = NULL;
+            arena->head = chunk;
+        } else {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+    }
+
+    arena->current = chunk;
+    void *ptr = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/*
+ * Release everything allocated since the last reset
+ * Keeps the first chunk so a typical line needs no heap allocation;
+ * overflow chunks from unusually large lines are returned to malloc.
+ */
+static void arena_reset(Arena *arena) {
+    if (arena->head == NULL) {
+        return;
+    }
+
+    ArenaChunk *chunk = arena->head->next;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->head->next = NULL;
+    arena->head->used = 0;
+    arena->current = arena->head;
+}
+
+/*
+ * Copy a string into an arena
+ */
+static char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/*
+ * Spelling of a token for syntax error messages
+ */
+static const char *token_text(const Token *tok) {
+    static const char *const redir_text[] = {
+        [REDIR_INPUT] = "<", [REDIR_OUTPUT] = ">",
+        [REDIR_APPEND] = ">>", [REDIR_DUP] = ">&",
+    };
+
+    switch (tok->kind) {
+    case TOK_EOF:    return "newline";
+    case TOK_WORD:   return tok->text;
+    case TOK_PIPE:   return "|";
+    case TOK_AMP:    return "&";
+    case TOK_AND_IF: return "&&";
+    case TOK_OR_IF:  return "||";
+    case TOK_SEMI:   return ";";
+    case TOK_REDIR:  return redir_text[tok->redir];
+    }
+    return "?";
+}
+
+/*
+ * Lex an operator: | || & && ; < > >> >& with an optional digit prefix
+ * Returns: Position just past the operator
+ */
+static char *lex_operator(char *p, Token *tok) {
+    int explicit_fd = -1;
+
+    if (isdigit((unsigned char)p[0])) {
+        explicit_fd = p[0] - '0';
+        p++;
+    }
+
+    switch (*p) {
+    case '|':
+        tok->kind = p[1] == '|' ? TOK_OR_IF : TOK_PIPE;
+        return p + (tok->kind == TOK_OR_IF ? 2 : 1);
+    case '&':
+        tok->kind = p[1] == '&' ? TOK_AND_IF : TOK_AMP;
+        return p + (tok->kind == TOK_AND_IF ? 2 : 1);
+    case ';':
+        tok->kind = TOK_SEMI;
+        return p + 1;
+    case '<':
+        tok->kind = TOK_REDIR;
+        tok->redir = REDIR_INPUT;
+        tok->fd = explicit_fd >= 0 ? explicit_fd : STDIN_FILENO;
+        return p + 1;
+    default:
+        tok->kind = TOK_REDIR;
+        tok->fd = explicit_fd >= 0 ? explicit_fd : STDOUT_FILENO;
+        if (p[1] == '>') {
+            tok->redir = REDIR_APPEND;
+            return p + 2;
+        }
+        if (p[1] == '&') {
+            tok->redir = REDIR_DUP;
+            return p + 2;
+        }
+        tok->redir = REDIR_OUTPUT;
+        return p + 1;
+    }
+}
+
+/*
+ * Cook the '$' at *r into *w: an expansion marker if a name, {name}, ?
+ * or $ follows, otherwise a literal '$'
+ * "$$" is consumed whole so its second '$' is not lexed again.
+ */
+static void lex_dollar(char **r, char **w, Token *tok, bool quoted) {
+    unsigned char next = (unsigned char)(*r)[1];
+
+    if (isalpha(next) || next == '_' || next == '{' || next == '?' || next == '$') {
+        tok->expand = true;
+        *(*w)++ = quoted ? EXPAND_MARK_QUOTED : EXPAND_MARK;
+        if (next == '$' || next == '?') {
+            // Consume the special parameter here so an unquoted '?' is
+            // not taken for a glob by the next pass of lex_word().
+            *(*w)++ = (char)next;
+            (*r)++;
+        } else if (next == '{' && ((*r)[2] == '?' || (*r)[2] == '$') && (*r)[3] == '}') {
+            // Likewise for ${?} and ${$}.
+            memcpy(*w, *r + 1, 3);
+            *w += 3;
+            *r += 3;
+        }
+    } else {
+        *(*w)++ = '$';
+    }
+    (*r)++;
+}
+
+/*
+ * Cook the unquoted glob character at *r into *w
+ * A '[' is only a bracket expression when a ']' follows in the same
+ * word, so the test command "[" stays an ordinary word.
+ */
+static void lex_glob(char **r, char **w, Token *tok) {
+    char c = **r;
+    bool magic = true;
+
+    if (c == '[') {
+        const char *p = *r + 1;
+        while (*p != ']' && char_class[(unsigned char)*p] != CC_END
+               && char_class[(unsigned char)*p] != CC_BLANK
+               && char_class[(unsigned char)*p] != CC_OPERATOR) {
+            p++;
+        }
+        magic = *p == ']';
+    }
+
+    if (magic) {
+        tok->expand = true;
+        *(*w)++ = c == '*' ? GLOB_STAR : c == '?' ? GLOB_QUESTION : GLOB_BRACKET;
+    } else {
+        *(*w)++ = c;
+    }
+    (*r)++;
+}
+
+/*
+ * Lex one word starting at r, removing quotes and escapes in place
+ * The cooked word never outgrows its source, so it is written back over
+ * the input behind the read position.
+ * Returns: Position of the terminating blank/operator/NUL, NULL on an
+ * unterminated quote (already reported)
+ */
+static char *lex_word(char *r, Token *tok) {
+    char *w = r;
+
+    tok->kind = TOK_WORD;
+    tok->text = r;
+    tok->expand = false;
+
+    for (bool first = true; ; first = false) {
+        char *run = r;
+        while (char_class[(unsigned char)*r] == 0) {
+            r++;
+        }
+        if (w != run) {
+            memmove(w, run, (size_t)(r - run));
+        }
+        w += r - run;
+        if (first) {
+            tok->plain_len = (size_t)(r - run);
+        }
+
+        if (*r == '$') {
+            lex_dollar(&r, &w, tok, false);
+        } else if (char_class[(unsigned char)*r] == CC_GLOB) {
+            lex_glob(&r, &w, tok);
+        } else if (*r == '\'') {
+            // Single quotes: everything literal up to the closing quote.
+            for (r++; *r != '\'' && *r != '\0'; ) {
+                *w++ = *r++;
+            }
+            if (*r == '\0') {
+                fprintf(stderr, COLOR_ERROR "syntax error: unterminated '\n" COLOR_RESET);
+                return NULL;
+            }
+            r++;
+        } else if (*r == '"') {
+            // Double quotes: backslash only escapes " \ $ ` and newline.
+            for (r++; *r != '"' && *r != '\0'; ) {
+                if (r[0] == '\\' && r[1] != '\0' && strchr("\"\\$`\n", r[1]) != NULL) {
+                    r++;
+                    *w++ = *r++;
+                } else if (*r == '$') {
+                    lex_dollar(&r, &w, tok, true);
+                } else {
+                    *w++ = *r++;
+                }
+            }
+            if (*r == '\0') {
+                fprintf(stderr, COLOR_ERROR "syntax error: unterminated \"\n" COLOR_RESET);
+                return NULL;
+            }
+            r++;
+        } else if (*r == '\\') {
+            // A trailing backslash would continue the line; drop it.
+            r++;
+            if (*r != '\0') {
+                *w++ = *r++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    tok->len = (size_t)(w - tok->text);
+    return r;
+}
+
+/*
+ * Produce the next token of the line
+ * Words are unquoted and NUL-terminated in place, so tok->text points
+ * into the line; nothing is copied.
+ * Returns: false on a syntax error (already reported); TOK_EOF at the
+ * end of the line or at a comment
+ */
+static bool lex_next(Lexer *lx, Token *tok) {
+    if (lx->has_pending) {
+        *tok = lx->pending;
+        lx->has_pending = false;
+        return true;
+    }
+
+    char *p = lx->pos;
+    while (char_class[(unsigned char)*p] == CC_BLANK) {
+        p++;
+    }
+
+    // A word starting with '#' begins a comment (also skips "#!" lines).
+    if (*p == '\0' || *p == '#') {
+        tok->kind = TOK_EOF;
+        lx->pos = p;
+        return true;
+    }
+
+    if (char_class[(unsigned char)*p] == CC_OPERATOR
+        || (isdigit((unsigned char)p[0]) && (p[1] == '<' || p[1] == '>'))) {
+        lx->pos = lex_operator(p, tok);
+        return true;
+    }
+
+    char *end = lex_word(p, tok);
+    if (end == NULL) {
+        return false;
+    }
+
+    char *nul = tok->text + tok->len;
+    if (nul == end && char_class[(unsigned char)*end] == CC_OPERATOR) {
+        lx->pos = lex_operator(end, &lx->pending);
+        lx->has_pending = true;
+    } else if (nul == end && *end != '\0') {
+        lx->pos = end + 1;      // The blank is overwritten below.
+    } else {
+        lx->pos = end;
+    }
+    *nul = '\0';
+    return true;
+}
+
+/*
+ * Allocate an empty pipeline stage with a small NULL-terminated argv
+ */
+static Command *command_new(Arena *arena) {
+    Command *cmd = arena_alloc(arena, sizeof(Command));
+    if (cmd == NULL) {
+        return NULL;
+    }
+    cmd->args = arena_alloc(arena, INITIAL_ARGS * sizeof(char *));
+    if (cmd->args == NULL) {
+        return NULL;
+    }
+    cmd->args_cap = INITIAL_ARGS;
+    return cmd;
+}
+
+/*
+ * Append to a NULL-terminated arena vector, doubling it when full
+ * A NULL vector starts at INITIAL_ARGS slots. The old vector stays in
+ * the arena; doubling keeps the copies linear.
+ */
+static bool vector_push(Arena *arena, char ***vec, int *count, int *cap, char *item) {
+    // Keep one slot free for the NULL terminator.
+    if (*count + 1 >= *cap) {
+        int grown_cap = *cap > 0 ? *cap * 2 : INITIAL_ARGS;
+        char **grown = arena_alloc(arena, (size_t)grown_cap * sizeof(char *));
+        if (grown == NULL) {
+            return false;
+        }
+        if (*count > 0) {
+            memcpy(grown, *vec, (size_t)*count * sizeof(char *));
+        }
+        *vec = grown;
+        *cap = grown_cap;
+    }
+    (*vec)[(*count)++] = item;
+    (*vec)[*count] = NULL;
+    return true;
+}
+
+/*
+ * Append one argument to a stage
+ * Returns: false on allocation failure or when the stage would exceed
+ * ARG_MAX (already reported)
+ */
+static bool command_add_arg(Arena *arena, Command *cmd, char *arg) {
+    static long arg_max;
+
+    if (arg_max == 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) {
+            arg_max = LONG_MAX;
+        }
+    }
+
+    cmd->arg_bytes += strlen(arg) + 1 + sizeof(char *);
+    if (cmd->arg_bytes > (size_t)arg_max) {
+        fprintf(stderr, COLOR_ERROR "%s: argument list too long\n" COLOR_RESET,
+                cmd->args[0]);
+        return false;
+    }
+
+    return vector_push(arena, &cmd->args, &cmd->argc, &cmd->args_cap, arg);
+}
+
+/*
+ * Check for a valid variable name: [A-Za-z_][A-Za-z0-9_]*
+ */
+static bool valid_name(const char *name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Check whether a word is a NAME=value assignment
+ * The name and '=' must be unquoted: "A=1" cmd passes a plain argument.
+ */
+static bool is_assignment(const Token *tok) {
+    const char *eq = memchr(tok->text, '=', tok->plain_len);
+    return eq != NULL && valid_name(tok->text, (size_t)(eq - tok->text));
+}
+
+/*
+ * Check whether a stage has nothing in it yet
+ */
+static bool command_empty(const Command *cmd) {
+    return cmd->argc == 0 && cmd->nredirs == 0 && cmd->nassigns == 0;
+}
+
+/*
+ * Allocate an empty pipeline with one empty stage
+ */
+static Pipeline *pipeline_new(Arena *arena) {
+    Pipeline *pipeline = arena_alloc(arena, sizeof(Pipeline));
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    pipeline->first = command_new(arena);
+    return pipeline->first != NULL ? pipeline : NULL;
+}
+
+/*
+ * Parse input line into a command list of Pipelines
+ * Pulls tokens from the lexer, groups words into stages split at '|',
+ * attaches redirections to the stage they appear in, and splits
+ * pipelines at ';', '&', '&&' and '||'
+ * Args point into line and the list lives in the arena, so both must
+ * outlive the returned list.
+ * Returns: First pipeline (nstages == 0 for a blank line), NULL on error
+ */
+static Pipeline *parse_line(char *line, Arena *arena) {
+    Lexer lx = { .pos = line };
+    Token tok;
+
+    Pipeline *head = pipeline_new(arena);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    Pipeline *pipeline = head;
+    Command *cmd = pipeline->first;
+    Redirect **redir_tail = &cmd->redirs;
+    Connector join = CONNECT_SEQ;   // Connector before the current pipeline
+
+    for (;;) {
+        if (!lex_next(&lx, &tok)) {
+            return NULL;
+        }
+        if (tok.kind == TOK_EOF) {
+            break;
+        }
+
+        switch (tok.kind) {
+        case TOK_WORD:
+            if (cmd->argc == 0 && is_assignment(&tok)) {
+                if (!vector_push(arena, &cmd->assigns, &cmd->nassigns, &cmd->assigns_cap,
+                                 tok.text)) {
+                    return NULL;
+                }
+            } else if (!command_add_arg(arena, cmd, tok.text)) {
+                return NULL;
+            }
+            cmd->expand |= tok.expand;
+            break;
+
+        case TOK_REDIR: {
+            Token target;
+            if (!lex_next(&lx, &target)) {
+                return NULL;
+            }
+            if (target.kind != TOK_WORD
+                || (tok.redir == REDIR_DUP && !isdigit((unsigned char)target.text[0]))) {
+                fprintf(stderr, COLOR_ERROR "syntax error near '%s'\n" COLOR_RESET,
+                        token_text(&target));
+                return NULL;
+            }
+            if (cmd->nredirs == MAX_REDIRECTS) {
+                fprintf(stderr, COLOR_ERROR "too many redirections\n" COLOR_RESET);
+                return NULL;
+            }
+
+            Redirect *redir = arena_alloc(arena, sizeof(Redirect));
+            if (redir == NULL) {
+                return NULL;
+            }
+            redir->type = tok.redir;
+            redir->fd = tok.fd;
+            redir->target = target.text;
+            cmd->expand |= target.expand;
+            *redir_tail = redir;
+            redir_tail = &redir->next;
+            cmd->nredirs++;
+            break;
+        }
+
+        case TOK_PIPE: {
+            if (command_empty(cmd)) {
+                fprintf(stderr, COLOR_ERROR "syntax error near '|'\n" COLOR_RESET);
+                return NULL;
+            }
+            Command *next = command_new(arena);
+            if (next == NULL) {
+                return NULL;
+            }
+            cmd->next = next;
+            pipeline->nstages++;
+            cmd = next;
+            redir_tail = &cmd->redirs;
+            break;
+        }
+
+        default: {
+            // ; & && || end the current pipeline.
+            if (command_empty(cmd)) {
+                fprintf(stderr, COLOR_ERROR "syntax error near '%s'\n" COLOR_RESET,
+                        token_text(&tok));
+                return NULL;
+            }
+            pipeline->nstages++;
+            pipeline->background = tok.kind == TOK_AMP;
+            pipeline->connector = tok.kind == TOK_AND_IF ? CONNECT_AND
+                                : tok.kind == TOK_OR_IF ? CONNECT_OR : CONNECT_SEQ;
+            join = pipeline->connector;
+
+            Pipeline *next = pipeline_new(arena);
+            if (next == NULL) {
+                return NULL;
+            }
+            pipeline->next = next;
+            pipeline = next;
+            cmd = pipeline->first;
+            redir_tail = &cmd->redirs;
+            break;
+        }
+        }
+    }
+
+    if (!command_empty(cmd)) {
+        pipeline->nstages++;
+    } else if (pipeline->nstages > 0) {
+        // Trailing '|' with nothing after it.
+        fprintf(stderr, COLOR_ERROR "syntax error near '|'\n" COLOR_RESET);
+        return NULL;
+    } else if (join != CONNECT_SEQ) {
+        // Trailing '&&' or '||'.
+        fprintf(stderr, COLOR_ERROR "syntax error near 'newline'\n" COLOR_RESET);
+        return NULL;
+    }
+
+    return head;
+}
+
+/*
+ * Parse a line, reusing the tree built for an earlier identical line
+ * Generated scripts and polling drivers repeat the same text thousands
+ * of times; a hit costs one hash and one memcmp. Cached pipelines are
+ * shared between executions, so the executor treats them as read-only.
+ * Lines with syntax errors are not cached and report every time.
+ * Returns: Parsed pipeline, NULL on error
+ */
+static Pipeline *parse_cached(char *line, Arena *arena) {
+    size_t len = strlen(line);
+    if (len > PARSE_CACHE_MAX_LINE) {
+        return parse_line(line, arena);
+    }
+
+    size_t hash = hash_string(line);
+    ParsedLine **bucket = &parse_cache.buckets[hash % PARSE_CACHE_BUCKETS];
+    for (ParsedLine *entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len
+            && memcmp(entry->text, line, len) == 0) {
+            return entry->pipeline;
+        }
+    }
+
+    if (parse_cache.count == PARSE_CACHE_MAX_ENTRIES) {
+        memset(parse_cache.buckets, 0, sizeof(parse_cache.buckets));
+        arena_reset(&parse_cache.arena);
+        parse_cache.count = 0;
+    }
+
+    // Parse a private copy so the tree's words outlive the input buffer.
+    ParsedLine *entry = arena_alloc(&parse_cache.arena, sizeof(ParsedLine));
+    char *text = arena_strndup(&parse_cache.arena, line, len);
+    char *work = arena_strndup(&parse_cache.arena, line, len);
+    if (entry == NULL || text == NULL || work == NULL) {
+        return parse_line(line, arena);
+    }
+
+    Pipeline *pipeline = parse_line(work, &parse_cache.arena);
+    if (pipeline == NULL) {
+        return NULL;
+    }
+
+    entry->hash = hash;
+    entry->len = len;
+    entry->text = text;
+    entry->pipeline = pipeline;
+    entry->next = *bucket;
+    *bucket = entry;
+    parse_cache.count++;
+    return pipeline;
+}
+
+/*
+ * Setup signal handlers for shell
+ */
+static void setup_signal_handlers(bool interactive) {
+    struct sigaction sa;
+
+    // SIGCHLD only pokes a pipe; the main loop does the reaping.
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe2");
+    }
+
+    // Handle SIGCHLD to notice finished background processes
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+    }
+    
+    // Ignore SIGINT (Ctrl+C) in an interactive shell itself
+    // Child processes will still receive it
+    if (interactive) {
+        signal(SIGINT, SIG_IGN);
+    }
+}
+
+/*
+ * Signal handler for SIGCHLD
+ * Only async-signal-safe work: wake the main loop through the self-pipe.
+ * Reaping happens in reap_jobs(), per job pid, so it can never steal a
+ * foreground child from waitpid().
+ */
+static void sigchld_handler(int signo) {
+    (void)signo;
+
+    int saved_errno = errno;
+    if (sigchld_pipe[1] >= 0) {
+        // A full pipe already guarantees a pending wakeup.
+        ssize_t ignored = write(sigchld_pipe[1], "c", 1);
+        (void)ignored;
+    }
+    errno = saved_errno;
+}
+
+/*
+ * Watch fd while the shell waits for input
+ * Returns: false if the table is full
+ */
+static bool event_add(int fd, short events, EventHandler handler, void *data) {
+    if (event_loop.count == MAX_EVENT_SOURCES) {
+        fprintf(stderr, COLOR_ERROR "too many event sources\n" COLOR_RESET);
+        return false;
+    }
+    event_loop.sources[event_loop.count++] = (EventSource){
+        .fd = fd, .events = events, .handler = handler, .data = data,
+    };
+    return true;
+}
+
+/*
+ * Block until fd is readable, servicing every other event source as it
+ * becomes ready; handlers run before the next line is read so their
+ * output lands ahead of the next command's
+ * Hangups and errors on fd also return, leaving read() to report them.
+ * With fd -1 (poll() skips it) the sources are serviced forever.
+ */
+static void event_wait_readable(int fd) {
+    struct pollfd pfds[MAX_EVENT_SOURCES + 1];
+    EventSource ready[MAX_EVENT_SOURCES];
+
+    while (true) {
+        // Snapshot the sources: handlers may register new ones.
+        size_t n = event_loop.count;
+        memcpy(ready, event_loop.sources, n * sizeof(EventSource));
+
+        pfds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        for (size_t i = 0; i < n; i++) {
+            pfds[i + 1] = (struct pollfd){ .fd = ready[i].fd, .events = ready[i].events };
+        }
+
+        if (poll(pfds, n + 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (pfds[i + 1].revents != 0) {
+                ready[i].handler(ready[i].fd, pfds[i + 1].revents, ready[i].data);
+            }
+        }
+        if (pfds[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * SIGCHLD wakeup while waiting for input: reap background jobs at once
+ * and, interactively, announce finished ones without waiting for Enter
+ */
+static void sigchld_event(int fd, short revents, void *data) {
+    (void)fd;
+    (void)revents;
+    (void)data;
+
+    reap_jobs();
+    if (!shell_interactive || !jobs_finished()) {
+        return;
+    }
+
+    // The cursor sits after the prompt; report on a fresh line and redraw.
+    bool editing = line_editor.active;
+    if (editing) {
+        editor_suspend();
+    }
+    out_putc('\n');
+    notify_jobs();
+    if (prompt_enabled && !editing) {
+        display_prompt();
+    }
+    out_flush();
+    if (editing) {
+        editor_resume();
+    }
+}
+
+/*
+ * Pick the launch backend, honouring MYSHELL_SPAWN if it is set
+ */
+static void select_spawn_backend(void) {
+    const char *choice = getenv("MYSHELL_SPAWN");
+
+    if (choice == NULL || *choice == '\0') {
+        return;
+    }
+
+    if (strcmp(choice, "fork") == 0) {
+        spawn_backend = SPAWN_BACKEND_FORK;
+    } else if (strcmp(choice, "posix_spawn") == 0) {
+        spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+    } else {
+        fprintf(stderr, COLOR_ERROR "MYSHELL_SPAWN: unknown backend '%s'\n" COLOR_RESET,
+                choice);
+    }
+}
+
+/*
+ * Read the monotonic clock in nanoseconds
+ */
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * --startup-trace: report the time since the previous phase ended
+ * Lazy subsystems call this too, so their first use shows up in place.
+ */
+static void startup_phase(const char *phase) {
+    if (!startup_trace) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    fprintf(stderr, "startup: %-20s %9.1f us  (at %9.1f us)\n", phase,
+            (double)(now - startup_last_ns) / 1000.0,
+            (double)(now - startup_begin_ns) / 1000.0);
+    startup_last_ns = now;
+}
+
+/*
+ * --startup-trace: report a lazily initialised subsystem that started at
+ * start (0 when tracing is off)
+ */
+static void startup_lazy(const char *phase, uint64_t start) {
+    if (!startup_trace) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    fprintf(stderr, "startup: %-20s %9.1f us  (lazy, at %9.1f us)\n", phase,
+            (double)(now - start) / 1000.0, (double)(now - startup_begin_ns) / 1000.0);
+}
+
+/*
+ * Hash a NUL-terminated string (FNV-1a)
+ */
+static size_t hash_string(const char *str) {
+    size_t hash = 2166136261u;
+
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Hash the first len bytes of a string (FNV-1a)
+ */
+static size_t hash_bytes(const char *str, size_t len) {
+    size_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Find a variable by name (len bytes, not necessarily NUL-terminated)
+ */
+static Var *var_find(const char *name, size_t len) {
+    vars_init();
+    Var *var = var_store.buckets[hash_bytes(name, len) % VAR_BUCKETS];
+
+    for (; var != NULL; var = var->next) {
+        if (var->name_len == len && memcmp(var->entry, name, len) == 0) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Store a malloc'd "NAME=value" entry, taking ownership of it
+ * export marks the variable exported; otherwise an existing variable
+ * keeps its flag and a new one stays local to the shell.
+ */
+static bool var_store_entry(char *entry, size_t name_len, bool export) {
+    Var *var = var_find(entry, name_len);
+
+    if (var == NULL) {
+        var = calloc(1, sizeof(Var));
+        if (var == NULL) {
+            perror("calloc");
+            free(entry);
+            return false;
+        }
+        size_t bucket = hash_bytes(entry, name_len) % VAR_BUCKETS;
+        var->name_len = name_len;
+        var->next = var_store.buckets[bucket];
+        var_store.buckets[bucket] = var;
+    }
+
+    free(var->entry);
+    var->entry = entry;
+    if (export && !var->exported) {
+        var->exported = true;
+        var_store.nexported++;
+    }
+    if (var->exported) {
+        var_store.envp_stale = true;
+    }
+    return true;
+}
+
+/*
+ * Set a variable from a "NAME=value" string (the name is not checked)
+ */
+static bool var_assign(const char *assignment, bool export) {
+    const char *eq = strchr(assignment, '=');
+    char *entry = strdup(assignment);
+
+    if (eq == NULL || entry == NULL) {
+        free(entry);
+        return false;
+    }
+    return var_store_entry(entry, (size_t)(eq - assignment), export);
+}
+
+/*
+ * Set a variable from a separate name and value
+ */
+static bool var_set(const char *name, const char *value, bool export) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    char *entry = malloc(name_len + value_len + 2);
+
+    if (entry == NULL) {
+        perror("malloc");
+        return false;
+    }
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+    return var_store_entry(entry, name_len, export);
+}
+
+/*
+ * Look up a variable's value
+ * Returns: value, or NULL if unset
+ */
+static const char *var_get(const char *name) {
+    Var *var = var_find(name, strlen(name));
+    return var != NULL ? var->entry + var->name_len + 1 : NULL;
+}
+
+/*
+ * Remove a variable
+ */
+static void var_unset(const char *name) {
+    vars_init();
+    size_t len = strlen(name);
+    Var **link = &var_store.buckets[hash_bytes(name, len) % VAR_BUCKETS];
+
+    for (; *link != NULL; link = &(*link)->next) {
+        Var *var = *link;
+        if (var->name_len == len && memcmp(var->entry, name, len) == 0) {
+            if (var->exported) {
+                var_store.nexported--;
+                var_store.envp_stale = true;
+            }
+            *link = var->next;
+            free(var->entry);
+            free(var);
+            return;
+        }
+    }
+}
+
+/*
+ * Import the process environment as exported variables
+ */
+static void var_import(char **env) {
+    for (; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq != NULL && valid_name(*env, (size_t)(eq - *env))) {
+            var_assign(*env, true);
+        }
+    }
+}
+
+/*
+ * Import environ and settle the working directory, once, on first use
+ * A -c command or script that never touches a variable skips both.
+ */
+static void vars_init(void) {
+    if (vars_ready) {
+        return;
+    }
+    vars_ready = true;
+    uint64_t start = startup_trace ? monotonic_ns() : 0;
+    var_import(environ);
+    init_shell_cwd();
+    startup_lazy("variables, cwd", start);
+}
+
+/*
+ * Environment for children: the exported variables as "NAME=value"
+ * The array is rebuilt only after an exported variable changed, so
+ * thousands of launches share one walk of the table; before the store
+ * is first touched it is environ itself.
+ * Returns: NULL-terminated array owned by the store
+ */
+static char **var_envp(void) {
+    if (!vars_ready) {
+        return environ;
+    }
+    if (var_store.envp != NULL && !var_store.envp_stale) {
+        return var_store.envp;
+    }
+
+    if (var_store.envp_cap < var_store.nexported + 1) {
+        size_t cap = var_store.nexported + 1;
+        char **grown = realloc(var_store.envp, cap * sizeof(char *));
+        if (grown == NULL) {
+            perror("realloc");
+            return var_store.envp != NULL ? var_store.envp : environ;
+        }
+        var_store.envp = grown;
+        var_store.envp_cap = cap;
+    }
+
+    size_t n = 0;
+    for (size_t b = 0; b < VAR_BUCKETS; b++) {
+        for (Var *var = var_store.buckets[b]; var != NULL; var = var->next) {
+            if (var->exported) {
+                var_store.envp[n++] = var->entry;
+            }
+        }
+    }
+    var_store.envp[n] = NULL;
+    var_store.envp_stale = false;
+    return var_store.envp;
+}
+
+/*
+ * Environment for one command: the cached envp, or for a command with
+ * NAME=value prefixes a line-arena copy of it with those layered on top
+ */
+static char **command_envp(const Command *cmd) {
+    if (cmd->nassigns == 0) {
+        return var_envp();
+    }
+
+    vars_init();
+    char **base = var_envp();
+
+    size_t n = var_store.nexported;
+    char **envp = arena_alloc(&line_arena, (n + (size_t)cmd->nassigns + 1) * sizeof(char *));
+    if (envp == NULL) {
+        return base;
+    }
+    memcpy(envp, base, n * sizeof(char *));
+
+    for (int i = 0; i < cmd->nassigns; i++) {
+        const char *assign = cmd->assigns[i];
+        size_t name_len = (size_t)(strchr(assign, '=') - assign) + 1;
+        size_t j = 0;
+
+        while (j < n && strncmp(envp[j], assign, name_len) != 0) {
+            j++;
+        }
+        envp[j] = (char *)assign;
+        if (j == n) {
+            n++;
+        }
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+/*
+ * Apply a stage's NAME=value prefixes to the shell variables
+ * Returns: for saved != NULL, the previous values in saved[] so
+ * restore_assignments() can undo them after a builtin
+ */
+static void apply_assignments(const Command *cmd, SavedVar *saved) {
+    for (int i = 0; i < cmd->nassigns; i++) {
+        const char *assign = cmd->assigns[i];
+        size_t name_len = (size_t)(strchr(assign, '=') - assign);
+
+        if (saved != NULL) {
+            Var *old = var_find(assign, name_len);
+            saved[i].entry = old != NULL ? strdup(old->entry) : NULL;
+            saved[i].exported = old != NULL && old->exported;
+        }
+        // Temporary values are exported so a builtin's children see them.
+        var_assign(assign, saved != NULL);
+    }
+}
+
+/*
+ * Undo apply_assignments(), last first so repeated names unwind
+ */
+static void restore_assignments(const Command *cmd, SavedVar *saved) {
+    for (int i = cmd->nassigns - 1; i >= 0; i--) {
+        const char *assign = cmd->assigns[i];
+        size_t name_len = (size_t)(strchr(assign, '=') - assign);
+
+        if (saved[i].entry == NULL) {
+            char name[name_len + 1];
+            memcpy(name, assign, name_len);
+            name[name_len] = '\0';
+            var_unset(name);
+            continue;
+        }
+
+        Var *var = var_find(assign, name_len);
+        if (var != NULL && var->exported && !saved[i].exported) {
+            var->exported = false;
+            var_store.nexported--;
+            var_store.envp_stale = true;
+        }
+        var_store_entry(saved[i].entry, name_len, saved[i].exported);
+    }
+}
+
+/*
+ * Parse the reference after an expansion marker: name, {name}, ? or $
+ * Returns: bytes consumed after the marker (0 for a bad ${...}), with
+ * the name span in *name / *name_len
+ */
+static size_t expansion_ref(const char *p, const char **name, size_t *name_len) {
+    if (*p == '?' || *p == '$') {
+        *name = p;
+        *name_len = 1;
+        return 1;
+    }
+    if (p[0] == '{' && (p[1] == '?' || p[1] == '$') && p[2] == '}') {
+        *name = p + 1;
+        *name_len = 1;
+        return 3;
+    }
+
+    bool braced = *p == '{';
+    const char *start = p + braced;
+    const char *end = start;
+    while (isalnum((unsigned char)*end) || *end == '_') {
+        end++;
+    }
+
+    *name = start;
+    *name_len = (size_t)(end - start);
+    if (braced) {
+        if (*end != '}' || !valid_name(start, *name_len)) {
+            return 0;
+        }
+        end++;
+    }
+    return (size_t)(end - p);
+}
+
+/*
+ * Value of a referenced variable; special parameters go through scratch
+ * Returns: value, "" if unset
+ */
+static const char *expansion_value(const char *name, size_t len, char *scratch,
+                                   size_t scratch_size) {
+    if (len == 1 && name[0] == '?') {
+        snprintf(scratch, scratch_size, "%d", last_status);
+        return scratch;
+    }
+    if (len == 1 && name[0] == '$') {
+        snprintf(scratch, scratch_size, "%d", (int)getpid());
+        return scratch;
+    }
+
+    Var *var = var_find(name, len);
+    return var != NULL ? var->entry + var->name_len + 1 : "";
+}
+
+/*
+ * Expand the markers in one cooked word into a vector
+ * With split, whitespace in unquoted expansions separates fields and a
+ * word that expands to nothing unquoted yields no field; without it the
+ * result is always exactly one string.
+ * Returns: false on a bad substitution (already reported)
+ */
+static bool expand_word(Arena *arena, const char *word, bool split,
+                        char ***vec, int *count, int *cap) {
+    char scratch[32];
+    const char *name;
+    size_t name_len;
+
+    // First pass sizes the result; splitting never makes it longer.
+    size_t total = 0;
+    for (const char *p = word; *p; ) {
+        if (*p == EXPAND_MARK || *p == EXPAND_MARK_QUOTED) {
+            size_t used = expansion_ref(p + 1, &name, &name_len);
+            if (used == 0) {
+                fprintf(stderr, COLOR_ERROR "%s: bad substitution\n" COLOR_RESET, p + 1);
+                return false;
+            }
+            total += strlen(expansion_value(name, name_len, scratch, sizeof(scratch)));
+            p += 1 + used;
+        } else {
+            total++;
+            p++;
+        }
+    }
+
+    char *out = arena_alloc(arena, total + 1);
+    if (out == NULL) {
+        return false;
+    }
+
+    char *field = out;
+    char *w = out;
+    bool have_field = false;
+
+    for (const char *p = word; *p; ) {
+        if (*p != EXPAND_MARK && *p != EXPAND_MARK_QUOTED) {
+            *w++ = *p++;
+            have_field = true;
+            continue;
+        }
+
+        bool quoted = *p == EXPAND_MARK_QUOTED;
+        p += 1 + expansion_ref(p + 1, &name, &name_len);
+        const char *value = expansion_value(name, name_len, scratch, sizeof(scratch));
+
+        if (quoted || !split) {
+            size_t len = strlen(value);
+            memcpy(w, value, len);
+            w += len;
+            have_field = true;
+            continue;
+        }
+
+        for (; *value; value++) {
+            if (*value != ' ' && *value != '\t' && *value != '\n') {
+                *w++ = *value;
+                have_field = true;
+            } else if (have_field) {
+                *w++ = '\0';
+                if (!vector_push(arena, vec, count, cap, field)) {
+                    return false;
+                }
+                field = w;
+                have_field = false;
+            }
+        }
+    }
+
+    *w = '\0';
+    if (have_field || !split) {
+        return vector_push(arena, vec, count, cap, field);
+    }
+    return true;
+}
+
+
+/*
+ * Check for glob marker bytes left by the lexer
+ */
+static bool has_glob_marks(const char *word) {
+    for (const char *p = word; *p; p++) {
+        if (*p == GLOB_STAR || *p == GLOB_QUESTION || *p == GLOB_BRACKET) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Copy a word with its glob markers turned back into plain characters
+ * Used for words that are not globbed or matched nothing.
+ */
+static char *glob_literal(Arena *arena, const char *word) {
+    size_t len = strlen(word);
+    char *copy = arena_strndup(arena, word, len);
+    if (copy == NULL) {
+        return NULL;
+    }
+    for (char *p = copy; *p; p++) {
+        if (*p == GLOB_STAR) {
+            *p = '*';
+        } else if (*p == GLOB_QUESTION) {
+            *p = '?';
+        } else if (*p == GLOB_BRACKET) {
+            *p = '[';
+        }
+    }
+    return copy;
+}
+
+/*
+ * Free one directory listing
+ */
+static void dir_listing_free(DirListing *listing) {
+    free(listing->names);
+    free(listing->types);
+    free(listing->blob);
+    free(listing);
+}
+
+/*
+ * Housekeeping between globs, on the main thread with no workers
+ * running: free replaced listings and drop everything once the cache
+ * outgrows its budget.
+ */
+static void dir_cache_maintain(void) {
+    if (atomic_load(&dir_cache.pinned) > 0) {
+        return;
+    }
+    while (dir_cache.retired != NULL) {
+        DirListing *next = dir_cache.retired->next;
+        dir_listing_free(dir_cache.retired);
+        dir_cache.retired = next;
+    }
+
+    if (dir_cache.bytes <= DIR_CACHE_MAX_BYTES) {
+        return;
+    }
+    for (size_t b = 0; b < DIR_CACHE_BUCKETS; b++) {
+        while (dir_cache.buckets[b] != NULL) {
+            DirListing *next = dir_cache.buckets[b]->next;
+            dir_listing_free(dir_cache.buckets[b]);
+            dir_cache.buckets[b] = next;
+        }
+    }
+    dir_cache.bytes = 0;
+}
+
+/*
+ * Read every entry of an open directory with getdents64()
+ * Names are packed into one blob; d_type is kept so matching rarely
+ * needs stat().
+ * Returns: new listing, NULL on allocation failure
+ */
+static DirListing *dir_scan(int fd) {
+    DirListing *listing = calloc(1, sizeof(DirListing));
+    char *buf = malloc(DENTS_BUFFER_SIZE);
+    size_t *offsets = NULL;
+    size_t blob_cap = 0;
+    size_t cap = 0;
+
+    if (listing == NULL || buf == NULL) {
+        goto fail;
+    }
+
+    ssize_t n;
+    while ((n = getdents64(fd, buf, DENTS_BUFFER_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+
+            if (d->d_name[0] == '.'
+                && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+
+            size_t len = strlen(d->d_name) + 1;
+            if (listing->bytes + len > blob_cap) {
+                blob_cap = blob_cap > 0 ? blob_cap * 2 : 16384;
+                while (blob_cap < listing->bytes + len) {
+                    blob_cap *= 2;
+                }
+                char *grown = realloc(listing->blob, blob_cap);
+                if (grown == NULL) {
+                    goto fail;
+                }
+                listing->blob = grown;
+            }
+            if (listing->count == cap) {
+                cap = cap > 0 ? cap * 2 : 256;
+                size_t *grown_offsets = realloc(offsets, cap * sizeof(size_t));
+                if (grown_offsets == NULL) {
+                    goto fail;
+                }
+                offsets = grown_offsets;
+                unsigned char *grown_types = realloc(listing->types, cap);
+                if (grown_types == NULL) {
+                    goto fail;
+                }
+                listing->types = grown_types;
+            }
+
+            memcpy(listing->blob + listing->bytes, d->d_name, len);
+            offsets[listing->count] = listing->bytes;
+            listing->types[listing->count++] = d->d_type;
+            listing->bytes += len;
+        }
+    }
+
+    // The blob has stopped moving; turn offsets into pointers.
+    listing->names = malloc((listing->count + 1) * sizeof(char *));
+    if (listing->names == NULL) {
+        goto fail;
+    }
+    for (size_t i = 0; i < listing->count; i++) {
+        listing->names[i] = listing->blob + offsets[i];
+    }
+    listing->bytes += listing->count * (sizeof(char *) + sizeof(size_t) + 1);
+
+    free(offsets);
+    free(buf);
+    return listing;
+
+fail:
+    perror("glob");
+    free(offsets);
+    free(buf);
+    if (listing != NULL) {
+        dir_listing_free(listing);
+    }
+    return NULL;
+}
+
+/*
+ * Get the entries of a directory, from the cache when still valid
+ * Listings are keyed by (dev, inode) and checked against the directory's
+ * mtime. One scanned within a second of its mtime could miss a change
+ * made in the same timestamp tick, so it is rescanned next time. Safe to
+ * call from glob workers; listings are never freed while they run.
+ * Returns: listing, NULL if path is not a readable directory
+ */
+static DirListing *dir_listing(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    size_t bucket = ((size_t)st.st_dev * 31 + (size_t)st.st_ino) % DIR_CACHE_BUCKETS;
+    DirListing *hit = NULL;
+
+    pthread_mutex_lock(&dir_cache.lock);
+    for (DirListing *entry = dir_cache.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino) {
+            if (entry->trusted && entry->mtime.tv_sec == st.st_mtim.tv_sec
+                && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                hit = entry;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dir_cache.lock);
+    if (hit != NULL) {
+        return hit;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    fstat(fd, &st);
+    DirListing *listing = dir_scan(fd);
+    close(fd);
+    if (listing == NULL) {
+        return NULL;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->trusted = now.tv_sec > st.st_mtim.tv_sec + 1;
+
+    // Replace any older listing of the same directory.
+    pthread_mutex_lock(&dir_cache.lock);
+    for (DirListing **link = &dir_cache.buckets[bucket]; *link != NULL; link = &(*link)->next) {
+        DirListing *old = *link;
+        if (old->dev == listing->dev && old->ino == listing->ino) {
+            *link = old->next;
+            dir_cache.bytes -= old->bytes;
+            old->next = dir_cache.retired;
+            dir_cache.retired = old;
+            break;
+        }
+    }
+    listing->next = dir_cache.buckets[bucket];
+    dir_cache.buckets[bucket] = listing;
+    dir_cache.bytes += listing->bytes;
+    pthread_mutex_unlock(&dir_cache.lock);
+    return listing;
+}
+
+/*
+ * Build an fnmatch() pattern from one marked path component
+ * Markers become wildcards; literal wildcard characters are escaped.
+ * Returns: false if the component has no wildcards at all
+ */
+static bool glob_component_pattern(const char *comp, size_t len, char *pattern) {
+    bool magic = false;
+    char *o = pattern;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = comp[i];
+        if (c == GLOB_STAR || c == GLOB_QUESTION || c == GLOB_BRACKET) {
+            *o++ = c == GLOB_STAR ? '*' : c == GLOB_QUESTION ? '?' : '[';
+            magic = true;
+        } else {
+            if (c == '*' || c == '?' || c == '[' || c == '\\') {
+                *o++ = '\\';
+            }
+            *o++ = c;
+        }
+    }
+    *o = '\0';
+    return magic;
+}
+
+/*
+ * Record one match of a glob job
+ */
+static void glob_add(GlobJob *job, const char *path, size_t len) {
+    char *match = arena_strndup(job->arena, path, len);
+    if (match != NULL) {
+        vector_push(job->arena, &job->matches, &job->count, &job->cap, match);
+    }
+}
+
+/*
+ * Match the remaining components of a pattern below path
+ * path holds the directory matched so far ("" or ending in '/') and has
+ * room for PATH_MAX bytes.
+ */
+static void glob_walk(GlobJob *job, char *path, size_t path_len, const char *rest) {
+    const char *slash = strchr(rest, '/');
+    size_t comp_len = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = slash != NULL ? slash + 1 : NULL;
+    bool last = next == NULL || *next == '\0';
+    char pattern[2 * NAME_MAX + 2];
+
+    if (comp_len > NAME_MAX || path_len + comp_len + 2 >= PATH_MAX) {
+        return;
+    }
+
+    if (!glob_component_pattern(rest, comp_len, pattern)) {
+        // Literal component: no listing needed, just descend.
+        memcpy(path + path_len, rest, comp_len);
+        size_t len = path_len + comp_len;
+        if (slash != NULL) {
+            path[len++] = '/';
+        }
+        path[len] = '\0';
+
+        struct stat st;
+        if (!last) {
+            glob_walk(job, path, len, next);
+        } else if (lstat(path, &st) == 0 || (slash != NULL && stat(path, &st) == 0)) {
+            glob_add(job, path, len);
+        }
+        return;
+    }
+
+    path[path_len] = '\0';
+    DirListing *dir = dir_listing(path_len > 0 ? path : ".");
+    if (dir == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < dir->count; i++) {
+        const char *name = dir->names[i];
+        if (fnmatch(pattern, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+
+        size_t name_len = strlen(name);
+        if (path_len + name_len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + path_len, name, name_len + 1);
+        size_t len = path_len + name_len;
+
+        if (slash == NULL) {
+            glob_add(job, path, len);
+            continue;
+        }
+
+        // Only directories can match a component followed by '/'.
+        unsigned char type = dir->types[i];
+        if (type != DT_DIR) {
+            struct stat st;
+            if ((type != DT_UNKNOWN && type != DT_LNK)
+                || stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        }
+        path[len++] = '/';
+        path[len] = '\0';
+        if (last) {
+            glob_add(job, path, len);
+        } else {
+            glob_walk(job, path, len, next);
+        }
+    }
+}
+
+/*
+ * Expand one marked word into its sorted matches
+ */
+static void glob_run(GlobJob *job) {
+    char path[PATH_MAX];
+    const char *rest = job->word;
+    size_t path_len = 0;
+
+    if (*rest == '/') {
+        path[path_len++] = '/';
+        while (*rest == '/') {
+            rest++;
+        }
+    }
+    path[path_len] = '\0';
+
+    glob_walk(job, path, path_len, rest);
+    if (job->count > 1) {
+        qsort(job->matches, (size_t)job->count, sizeof(char *), compare_strings);
+    }
+}
+
+/*
+ * Worker thread: take words off the shared list until none are left
+ */
+static void *glob_worker(void *arg) {
+    GlobWorker *worker = arg;
+    GlobPool *pool = worker->pool;
+
+    while (true) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->count) {
+            return NULL;
+        }
+        pool->jobs[i].arena = worker->arena;
+        glob_run(&pool->jobs[i]);
+    }
+}
+
+/*
+ * Glob every marked field of an expanded stage, in place
+ * Several patterns on one line are matched on worker threads.
+ * Returns: false on allocation failure
+ */
+static bool glob_command(Command *cmd) {
+    int nglob = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        if (has_glob_marks(cmd->args[i])) {
+            nglob++;
+        }
+    }
+    if (nglob == 0) {
+        return true;
+    }
+
+    dir_cache_maintain();
+
+    GlobJob *jobs = arena_alloc(&line_arena, (size_t)nglob * sizeof(GlobJob));
+    if (jobs == NULL) {
+        return false;
+    }
+    int njobs = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        if (has_glob_marks(cmd->args[i])) {
+            jobs[njobs].word = cmd->args[i];
+            jobs[njobs++].arena = &line_arena;
+        }
+    }
+
+    static long ncpu;
+    if (ncpu == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        ncpu = ncpu < 1 ? 1 : ncpu > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : ncpu;
+    }
+    long nthreads = njobs < ncpu ? njobs : ncpu;
+
+    if (nthreads <= 1) {
+        for (int i = 0; i < njobs; i++) {
+            glob_run(&jobs[i]);
+        }
+    } else {
+        GlobPool pool = { .jobs = jobs, .count = (size_t)njobs };
+        GlobWorker workers[GLOB_MAX_THREADS];
+        pthread_t threads[GLOB_MAX_THREADS];
+        long started = 0;
+
+        atomic_init(&pool.next, 0);
+        // The calling thread is worker 0; matches land in per-worker arenas.
+        for (long t = 0; t < nthreads; t++) {
+            workers[t].pool = &pool;
+            workers[t].arena = t == 0 ? &line_arena : &glob_arenas[t];
+        }
+        for (long t = 1; t < nthreads; t++) {
+            if (pthread_create(&threads[t], NULL, glob_worker, &workers[t]) != 0) {
+                break;
+            }
+            started = t;
+        }
+        glob_worker(&workers[0]);
+        for (long t = 1; t <= started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    // Splice the matches (or the literal word) back in argument order.
+    char **args = NULL;
+    int argc = 0;
+    int cap = 0;
+    int job = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        bool ok = true;
+        if (!has_glob_marks(cmd->args[i])) {
+            ok = vector_push(&line_arena, &args, &argc, &cap, cmd->args[i]);
+        } else if (jobs[job].count == 0) {
+            char *literal = glob_literal(&line_arena, cmd->args[i]);
+            ok = literal != NULL && vector_push(&line_arena, &args, &argc, &cap, literal);
+            job++;
+        } else {
+            for (int m = 0; ok && m < jobs[job].count; m++) {
+                ok = vector_push(&line_arena, &args, &argc, &cap, jobs[job].matches[m]);
+            }
+            job++;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    cmd->args = args;
+    cmd->argc = argc;
+    cmd->args_cap = cap;
+    return true;
+}
+
+/*
+ * Expand one string without field splitting or globbing
+ * Returns: expanded string in the arena, NULL on error
+ */
+static char *expand_string(Arena *arena, const char *word) {
+    char **vec = NULL;
+    int count = 0;
+    int cap = 0;
+
+    if (strchr(word, EXPAND_MARK) != NULL || strchr(word, EXPAND_MARK_QUOTED) != NULL) {
+        if (!expand_word(arena, word, false, &vec, &count, &cap)) {
+            return NULL;
+        }
+        word = vec[0];
+    }
+    return has_glob_marks(word) ? glob_literal(arena, word) : (char *)word;
+}
+
+/*
+ * Copy a stage with its words, assignments and targets expanded
+ * Returns: expanded copy in the line arena, NULL on error
+ */
+static Command *expand_command(const Command *cmd) {
+    Command *copy = arena_alloc(&line_arena, sizeof(Command));
+    if (copy == NULL) {
+        return NULL;
+    }
+    *copy = *cmd;
+    copy->args = NULL;
+    copy->argc = 0;
+    copy->args_cap = 0;
+    copy->assigns = NULL;
+    copy->nassigns = 0;
+    copy->assigns_cap = 0;
+
+    for (int i = 0; i < cmd->argc; i++) {
+        const char *arg = cmd->args[i];
+        bool ok = strchr(arg, EXPAND_MARK) == NULL && strchr(arg, EXPAND_MARK_QUOTED) == NULL
+                  ? vector_push(&line_arena, &copy->args, &copy->argc, &copy->args_cap,
+                                (char *)arg)
+                  : expand_word(&line_arena, arg, true, &copy->args, &copy->argc,
+                                &copy->args_cap);
+        if (!ok) {
+            return NULL;
+        }
+    }
+    if (copy->args == NULL) {
+        copy->args = arena_alloc(&line_arena, INITIAL_ARGS * sizeof(char *));
+        copy->args_cap = INITIAL_ARGS;
+        if (copy->args == NULL) {
+            return NULL;
+        }
+    }
+    if (!glob_command(copy)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < cmd->nassigns; i++) {
+        char *assign = expand_string(&line_arena, cmd->assigns[i]);
+        if (assign == NULL || !vector_push(&line_arena, &copy->assigns, &copy->nassigns,
+                                           &copy->assigns_cap, assign)) {
+            return NULL;
+        }
+    }
+
+    Redirect **tail = &copy->redirs;
+    for (const Redirect *redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        Redirect *r = arena_alloc(&line_arena, sizeof(Redirect));
+        if (r == NULL) {
+            return NULL;
+        }
+        *r = *redir;
+        r->target = expand_string(&line_arena, redir->target);
+        if (r->target == NULL) {
+            return NULL;
+        }
+        *tail = r;
+        tail = &r->next;
+    }
+    *tail = NULL;
+    return copy;
+}
+
+/*
+ * Expand a pipeline for one execution
+ * The (possibly cached) tree is left untouched; stages that need it are
+ * expanded into line-arena copies, so expansion is the only per-run work.
+ * Returns: pipeline to execute (pipeline itself if nothing expands),
+ * NULL on error
+ */
+static Pipeline *expand_pipeline(Pipeline *pipeline) {
+    bool needed = false;
+    for (Command *cmd = pipeline->first; cmd != NULL; cmd = cmd->next) {
+        needed |= cmd->expand;
+    }
+    if (!needed) {
+        return pipeline;
+    }
+
+    Pipeline *copy = arena_alloc(&line_arena, sizeof(Pipeline));
+    if (copy == NULL) {
+        return NULL;
+    }
+    *copy = *pipeline;
+
+    Command **link = &copy->first;
+    for (Command *cmd = pipeline->first; cmd != NULL; cmd = cmd->next) {
+        Command *stage;
+        if (cmd->expand) {
+            stage = expand_command(cmd);
+        } else {
+            stage = arena_alloc(&line_arena, sizeof(Command));
+            if (stage != NULL) {
+                *stage = *cmd;
+            }
+        }
+        if (stage == NULL) {
+            return NULL;
+        }
+        *link = stage;
+        link = &stage->next;
+    }
+    *link = NULL;
+    return copy;
+}
+
+/*
+ * Hash a command name into a path cache bucket
+ */
+static size_t path_cache_bucket(const char *name) {
+    return hash_string(name) % PATH_CACHE_BUCKETS;
+}
+
+/*
+ * Drop every cached entry and reset the statistics
+ */
+static void path_cache_clear(void) {
+    for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        PathEntry *entry = path_cache.buckets[i];
+        while (entry != NULL) {
+            PathEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache.buckets[i] = NULL;
+    }
+
+    free(path_cache.path_snapshot);
+    path_cache.path_snapshot = NULL;
+    path_cache.count = 0;
+    path_cache.hits = 0;
+    path_cache.misses = 0;
+}
+
+/*
+ * Remove a single stale entry (e.g. the binary was deleted)
+ */
+static void path_cache_forget(const char *name) {
+    PathEntry **link = &path_cache.buckets[path_cache_bucket(name)];
+
+    while (*link != NULL) {
+        PathEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            path_cache.count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/*
+ * Walk $PATH for an executable regular file called name
+ * Returns: Dynamically allocated absolute path, or NULL if not found
+ */
+static char *search_path(const char *name, const char *path_var) {
+    size_t name_len = strlen(name);
+    const char *dir = path_var;
+
+    while (true) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+        // An empty PATH element means the current directory.
+        const char *prefix = dir_len > 0 ? dir : ".";
+        size_t prefix_len = dir_len > 0 ? dir_len : 1;
+
+        char *candidate = malloc(prefix_len + name_len + 2);
+        if (candidate == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        memcpy(candidate, prefix, prefix_len);
+        candidate[prefix_len] = '/';
+        memcpy(candidate + prefix_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode)
+            && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+ * Resolve a command name to an absolute path through the PATH cache
+ * Names containing a slash are used as-is, like execvp does
+ * Returns: Pointer owned by the cache (or name itself), NULL if not found
+ */
+static const char *lookup_command(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // Any change to PATH invalidates every resolution made against it.
+    const char *path_var = var_get("PATH");
+    if (path_var == NULL) {
+        path_var = DEFAULT_PATH;
+    }
+    if (path_cache.path_snapshot == NULL
+        || strcmp(path_cache.path_snapshot, path_var) != 0) {
+        path_cache_clear();
+        path_cache.path_snapshot = strdup(path_var);
+        if (path_cache.path_snapshot == NULL) {
+            perror("strdup");
+            return NULL;
+        }
+    }
+
+    size_t bucket = path_cache_bucket(name);
+    for (PathEntry *entry = path_cache.buckets[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            path_cache.hits++;
+            return entry->path;
+        }
+    }
+
+    path_cache.misses++;
+    char *resolved = search_path(name, path_var);
+    if (resolved == NULL) {
+        return NULL;
+    }
+
+    PathEntry *entry = calloc(1, sizeof(PathEntry));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+        perror("calloc");
+        free(entry);
+        free(resolved);
+        return NULL;
+    }
+    entry->path = resolved;
+    entry->hits = 1;
+    entry->next = path_cache.buckets[bucket];
+    path_cache.buckets[bucket] = entry;
+    path_cache.count++;
+
+    return entry->path;
+}
+
+/*
+ * Open a stage's redirection targets and lay out its descriptor moves
+ * Pipe ends come first so that redirections override them, as in sh.
+ * Files are opened here in the parent (O_CLOEXEC, at 10 or above) and
+ * dup2'd straight into the child; the shell never copies the data itself.
+ * Returns: false (error printed, nothing left open) if a file can't be opened
+ */
+static bool build_fd_plan(Command *cmd, int in_fd, int out_fd, FdPlan *plan) {
+    plan->count = 0;
+
+    if (in_fd != STDIN_FILENO) {
+        plan->source[plan->count] = in_fd;
+        plan->target[plan->count] = STDIN_FILENO;
+        plan->owned[plan->count++] = false;
+    }
+    if (out_fd != STDOUT_FILENO) {
+        plan->source[plan->count] = out_fd;
+        plan->target[plan->count] = STDOUT_FILENO;
+        plan->owned[plan->count++] = false;
+    }
+
+    for (Redirect *redir = cmd->redirs; redir != NULL; redir = redir->next) {
+        int source;
+
+        if (redir->type == REDIR_DUP) {
+            source = atoi(redir->target);
+        } else {
+            int flags = O_CLOEXEC;
+            if (redir->type == REDIR_INPUT) {
+                flags |= O_RDONLY;
+            } else if (redir->type == REDIR_APPEND) {
+                flags |= O_WRONLY | O_CREAT | O_APPEND;
+            } else {
+                flags |= O_WRONLY | O_CREAT | O_TRUNC;
+            }
+
+            source = open(redir->target, flags, 0666);
+            if (source >= 0 && source < 10) {
+                // Keep sources clear of every target (0-9), so no dup2
+                // of an earlier step can land on a later step's source.
+                int high = fcntl(source, F_DUPFD_CLOEXEC, 10);
+                int err = errno;
+                close(source);
+                source = high;
+                errno = err;
+            }
+            if (source < 0) {
+                fprintf(stderr, COLOR_ERROR "%s: %s\n" COLOR_RESET,
+                        redir->target, strerror(errno));
+                release_fd_plan(plan);
+                return false;
+            }
+        }
+
+        plan->source[plan->count] = source;
+        plan->target[plan->count] = redir->fd;
+        plan->owned[plan->count++] = redir->type != REDIR_DUP;
+    }
+    return true;
+}
+
+/*
+ * Close the redirection files the parent opened for a plan
+ */
+static void release_fd_plan(FdPlan *plan) {
+    for (int i = 0; i < plan->count; i++) {
+        if (plan->owned[i]) {
+            close(plan->source[i]);
+        }
+    }
+    plan->count = 0;
+}
+
+/*
+ * Reset signal state and apply a descriptor plan in a forked child
+ * Sources are O_CLOEXEC and disappear at exec time.
+ * Returns: false with errno set if a dup2() failed
+ */
+static bool child_setup_fds(const FdPlan *plan) {
+    sigset_t empty;
+
+    // Children start with an empty signal mask and default SIGINT.
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    signal(SIGINT, SIG_DFL);
+
+    for (int i = 0; i < plan->count; i++) {
+        if (plan->source[i] == plan->target[i]) {
+            // dup2 onto itself would keep FD_CLOEXEC; clear it explicitly.
+            fcntl(plan->target[i], F_SETFD, 0);
+        } else if (dup2(plan->source[i], plan->target[i]) == -1) {
+            return false;
+        }
+    }
+
+#ifdef HAVE_CLOSE_RANGE
+    // Backstop for any internal descriptor opened without O_CLOEXEC.
+    int floor = child_fd_floor(plan);
+    if (floor >= 0) {
+        close_range((unsigned int)floor, ~0U, CLOSE_RANGE_CLOEXEC);
+    }
+#endif
+    return true;
+}
+
+/*
+ * Exit status for a command that could not be executed: 127 when there
+ * is nothing to run, 126 when the file exists but cannot be executed
+ */
+static int exec_failure_status(int err) {
+    return err == ENOENT || err == ENOTDIR ? 127 : 126;
+}
+
+/*
+ * Report a failed exec, the same way for every launch backend
+ */
+static void report_exec_failure(const char *name, int err) {
+    launch_status = exec_failure_status(err);
+    if (err == ENOENT) {
+        fprintf(stderr, COLOR_ERROR "%s: command not found\n" COLOR_RESET, name);
+    } else {
+        fprintf(stderr, COLOR_ERROR "%s: %s\n" COLOR_RESET, name, strerror(err));
+    }
+}
+
+/*
+ * Exec path in a forked child; never returns
+ * A file without a #! line is run by /bin/sh, as execvp() does. On
+ * failure the errno goes up report_fd (CLOEXEC, so a successful exec
+ * closes it empty) for the parent to print: only system calls happen
+ * here, which keeps it safe in a clone3() child and beside other threads.
+ */
+static void child_exec(const char *path, char **args, char **envp, int report_fd) {
+    execve(path, args, envp);
+
+    int err = errno;
+    if (err == ENOEXEC) {
+        size_t argc = 0;
+        while (args[argc] != NULL) {
+            argc++;
+        }
+        // sh, the script, its arguments and the NULL; mmap, not malloc.
+        size_t size = (argc + 2) * sizeof(char *);
+        char **sh_args = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sh_args != MAP_FAILED) {
+            sh_args[0] = (char *)"sh";
+            sh_args[1] = (char *)path;
+            memcpy(sh_args + 2, args + 1, argc * sizeof(char *));
+            execve("/bin/sh", sh_args, envp);
+        }
+    }
+    child_fail(report_fd, CHILD_STEP_EXEC, err);
+}
+
+/*
+ * Send a setup failure to the parent and exit; never returns
+ * Only write() and _exit(), so safe in any forked or clone3() child.
+ */
+static void child_fail(int report_fd, ChildStep step, int err) {
+    ChildFailure failure = { .step = step, .err = err };
+
+    if (write(report_fd, &failure, sizeof(failure)) != (ssize_t)sizeof(failure)) {
+        // Nothing else to tell the parent with; the status still does.
+    }
+    _exit(step == CHILD_STEP_EXEC ? exec_failure_status(err) : 126);
+}
+
+/*
+ * Wait for a forked child to exec (or finish its setup), reporting the
+ * failure it sent if any
+ */
+static void await_child_exec(const char *name, int report_fd) {
+    ChildFailure failure;
+    ssize_t n;
+
+    do {
+        n = read(report_fd, &failure, sizeof(failure));
+    } while (n < 0 && errno == EINTR);
+    close(report_fd);
+
+    if (n != (ssize_t)sizeof(failure)) {
+        return;
+    }
+    const char *what = "setup";
+    switch ((ChildStep)failure.step) {
+    case CHILD_STEP_EXEC: report_exec_failure(name, failure.err); return;
+    case CHILD_STEP_FDS: what = "dup2"; break;
+    case CHILD_STEP_CGROUP: name = "limit"; what = "cgroup.procs"; break;
+    case CHILD_STEP_RLIMIT: name = "limit"; what = "setrlimit"; break;
+    case CHILD_STEP_PLACEMENT: name = "limit"; what = "placement"; break;
+    }
+    fprintf(stderr, COLOR_ERROR "%s: %s: %s\n" COLOR_RESET, name, what,
+            strerror(failure.err));
+}
+
+/*
+ * Lowest descriptor a child may lose at exec: above everything the shell
+ * inherited (passed through, as other shells do) and every plan target
+ * Returns: descriptor number, or -1 if the inherited set is unknown
+ */
+static int child_fd_floor(const FdPlan *plan) {
+    if (inherited_fd_end < 0) {
+        return -1;
+    }
+
+    int floor = inherited_fd_end;
+    for (int i = 0; i < plan->count; i++) {
+        if (plan->target[i] >= floor) {
+            floor = plan->target[i] + 1;
+        }
+    }
+    return floor;
+}
+
+/*
+ * Find the highest open descriptor
+ * The usual handful of low descriptors is probed with one poll(), whose
+ * POLLNVAL marks the closed ones; /proc/self/fd is only read when the
+ * top probe slot is open too.
+ * Returns: descriptor number, or -1 if /proc is needed and unavailable
+ */
+static int highest_open_fd(void) {
+    struct pollfd probe[FD_PROBE_COUNT];
+    for (int fd = 0; fd < FD_PROBE_COUNT; fd++) {
+        probe[fd] = (struct pollfd){ .fd = fd, .events = 0 };
+    }
+    if (poll(probe, FD_PROBE_COUNT, 0) >= 0 && (probe[FD_PROBE_COUNT - 1].revents & POLLNVAL)) {
+        int highest = FD_PROBE_COUNT - 1;
+        while (highest >= 0 && (probe[highest].revents & POLLNVAL)) {
+            highest--;
+        }
+        return highest;
+    }
+
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int highest = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+        int fd = atoi(entry->d_name);
+        if (fd != dirfd(dir) && fd > highest) {
+            highest = fd;
+        }
+    }
+    closedir(dir);
+    return highest;
+}
+
+/*
+ * Apply a descriptor plan to the shell itself around an in-process builtin
+ * saved[] receives the previous descriptors for restore_shell_fds()
+ * Returns: false if a descriptor could not be moved (everything restored)
+ */
+static bool apply_shell_fds(const FdPlan *plan, int *saved) {
+    flush_output();
+
+    for (int i = 0; i < plan->count; i++) {
+        // -1 records a target that was closed before the redirection.
+        saved[i] = fcntl(plan->target[i], F_DUPFD_CLOEXEC, 10);
+        if (dup2(plan->source[i], plan->target[i]) == -1) {
+            perror("dup2");
+            if (saved[i] >= 0) {
+                close(saved[i]);
+            }
+            for (int j = i - 1; j >= 0; j--) {
+                if (saved[j] >= 0) {
+                    dup2(saved[j], plan->target[j]);
+                    close(saved[j]);
+                } else {
+                    close(plan->target[j]);
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Undo apply_shell_fds(), most recent move first
+ */
+static void restore_shell_fds(const FdPlan *plan, int *saved) {
+    flush_output();
+
+    for (int i = plan->count - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], plan->target[i]);
+            close(saved[i]);
+        } else {
+            close(plan->target[i]);
+        }
+    }
+}
+
+/*
+ * Launch a child with fork/exec
+ * Fallback path for children that need setup before exec. Like
+ * posix_spawn, it returns once the child has exec'd, or after printing
+ * why it could not (the child then exits 126 or 127).
+ * Returns: child pid, or -1 if the fork failed
+ */
+static pid_t spawn_with_fork(Command *cmd, const char *path, const FdPlan *plan) {
+    char **envp = command_envp(cmd);
+    int report[2];
+
+    if (pipe2(report, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        // Fork failed
+        perror("fork");
+        close(report[0]);
+        close(report[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child process: reset signals, wire up descriptors, then execute
+        close(report[0]);
+        if (!child_setup_fds(plan)) {
+            child_fail(report[1], CHILD_STEP_FDS, errno);
+        }
+        child_exec(path, cmd->args, envp, report[1]);
+    }
+
+    close(report[1]);
+    await_child_exec(cmd->args[0], report[0]);
+    return pid;
+}
+
+/*
+ * Create a child under a command's resource limits
+ * clone3(CLONE_INTO_CGROUP) starts the child inside its cgroup, so not one
+ * instruction runs outside it and no helper process is needed. Children
+ * of clone3() must not touch malloc (the parent may be multithreaded),
+ * so callers that run shell code in the child pass allow_clone3 = false
+ * and get fork() plus a cgroup.procs write instead.
+ * The child sends any setup failure up report_fd and exits 126, rather
+ * than touching stdio beside the parent's other threads.
+ * Returns: 0 in the child with rlimits applied, child pid in the parent,
+ * or -1 with errno set
+ */
+static pid_t clone_limited(const ChildLimits *limits, bool allow_clone3, int report_fd) {
+    pid_t pid = -1;
+    bool placed = false;
+
+#ifdef HAVE_CLONE3
+    if (limits->cgroup_fd >= 0 && allow_clone3) {
+        struct clone_args args = {
+            .flags = CLONE_INTO_CGROUP,
+            .exit_signal = SIGCHLD,
+            .cgroup = (uint64_t)limits->cgroup_fd,
+        };
+        pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+        if (pid < 0 && errno != ENOSYS && errno != E2BIG) {
+            return -1;
+        }
+        placed = pid >= 0;
+    }
+#else
+    (void)allow_clone3;
+#endif
+
+    if (!placed) {
+        pid = fork();
+    }
+    if (pid != 0) {
+        return pid;
+    }
+
+    // Child: join the cgroup if clone3 did not, then lower the rlimits.
+    if (!placed && limits->procs_fd >= 0 && write(limits->procs_fd, "0", 1) != 1) {
+        child_fail(report_fd, CHILD_STEP_CGROUP, errno);
+    }
+    for (int i = 0; i < limits->nrlimits; i++) {
+        struct rlimit rl = { .rlim_cur = limits->value[i], .rlim_max = limits->value[i] };
+        if (setrlimit(limits->resource[i], &rl) != 0) {
+            child_fail(report_fd, CHILD_STEP_RLIMIT, errno);
+        }
+    }
+    if (!apply_placement(limits)) {
+        child_fail(report_fd, CHILD_STEP_PLACEMENT, errno);
+    }
+    return 0;
+}
+
+/*
+ * Pin the calling process to limits->cpus and bind its memory policy
+ * Plain system calls only, so it is safe in a clone3() child.
+ * Returns: false with errno set on failure
+ */
+static bool apply_placement(const ChildLimits *limits) {
+    if (limits->pin_cpus && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) != 0) {
+        return false;
+    }
+    if (limits->bind_memory) {
+        unsigned long nodemask = 1UL << limits->mem_node;
+        // maxnode counts one past the last bit, as in libnuma.
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, &nodemask,
+                    (unsigned long)MAX_NUMA_NODES + 1) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Launch an external command under cmd->limits
+ * Same child setup as spawn_with_fork, on top of clone_limited()
+ * Returns: child pid, or -1 if nothing was started (error already printed)
+ */
+static pid_t spawn_limited(Command *cmd, const char *path, const FdPlan *plan) {
+    char **envp = command_envp(cmd);
+    int report[2];
+
+    if (pipe2(report, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    pid_t pid = clone_limited(cmd->limits, true, report[1]);
+
+    if (pid < 0) {
+        fprintf(stderr, COLOR_ERROR "%s: %s\n" COLOR_RESET, cmd->args[0], strerror(errno));
+        close(report[0]);
+        close(report[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(report[0]);
+        if (!child_setup_fds(plan)) {
+            child_fail(report[1], CHILD_STEP_FDS, errno);
+        }
+        child_exec(path, cmd->args, envp, report[1]);
+    }
+
+    close(report[1]);
+    await_child_exec(cmd->args[0], report[0]);
+    return pid;
+}
+
+/*
+ * Launch a child with posix_spawn
+ * Common path: no page-table copy, exec failures reported to the parent
+ * Returns: child pid, or -1 with errno set
+ */
+static pid_t spawn_with_posix_spawn(Command *cmd, const char *path,
+                                    const FdPlan *plan) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, empty;
+    pid_t pid;
+    int err;
+
+    err = posix_spawnattr_init(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        posix_spawnattr_destroy(&attr);
+        errno = err;
+        return -1;
+    }
+
+    // The shell ignores SIGINT; children must get the default action
+    // back, and start with an empty signal mask.
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigemptyset(&empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    // adddup2 onto the same number also clears FD_CLOEXEC (glibc >= 2.29).
+    for (int i = 0; i < plan->count; i++) {
+        posix_spawn_file_actions_adddup2(&actions, plan->source[i], plan->target[i]);
+    }
+
+#ifdef HAVE_CLOSE_RANGE
+    // Backstop for any internal descriptor opened without O_CLOEXEC;
+    // glibc implements this with close_range() in the child.
+    int floor = child_fd_floor(plan);
+    if (floor >= 0) {
+        posix_spawn_file_actions_addclosefrom_np(&actions, floor);
+    }
+#endif
+
+    err = posix_spawn(&pid, path, &actions, &attr, cmd->args, command_envp(cmd));
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * posix_spawn /bin/sh path args... for a file the kernel cannot exec
+ * Returns: child pid, or -1 with errno set (ENOEXEC if sh cannot run)
+ */
+static pid_t spawn_sh_script(Command *cmd, const char *path, const FdPlan *plan) {
+    char **sh_args = malloc(((size_t)cmd->argc + 2) * sizeof(char *));
+    if (sh_args == NULL) {
+        errno = ENOEXEC;
+        return -1;
+    }
+
+    Command script = *cmd;
+    sh_args[0] = (char *)"sh";
+    sh_args[1] = (char *)path;
+    memcpy(sh_args + 2, cmd->args + 1, (size_t)cmd->argc * sizeof(char *));
+    script.args = sh_args;
+    script.argc = cmd->argc + 1;
+
+    pid_t pid = spawn_with_posix_spawn(&script, "/bin/sh", plan);
+    free(sh_args);
+    if (pid < 0) {
+        errno = ENOEXEC;
+    }
+    return pid;
+}
+
+/*
+ * Run a builtin as a pipeline stage in a forked child
+ * Returns: child pid, or -1 if the fork failed
+ */
+static pid_t spawn_builtin_stage(Command *cmd, const FdPlan *plan) {
+    // Under limit the child reports failing to apply them like an exec;
+    // it closes the pipe once they are in place.
+    int report[2] = { -1, -1 };
+    if (cmd->limits != NULL && pipe2(report, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    uint64_t started = monotonic_ns();
+    pid_t pid = cmd->limits != NULL ? clone_limited(cmd->limits, false, report[1]) : fork();
+
+    if (pid > 0) {
+        // Counted like execute_external(), so time/trace see the fork.
+        shell_counters.spawn_ns += monotonic_ns() - started;
+        shell_counters.launches++;
+    }
+    if (pid < 0) {
+        perror("fork");
+        if (report[0] >= 0) {
+            close(report[0]);
+            close(report[1]);
+        }
+        return -1;
+    }
+
+    if (pid == 0) {
+        // The child is disposable, so prefixes can be applied for good.
+        in_stage_child = true;
+        if (report[0] >= 0) {
+            close(report[0]);
+            close(report[1]);
+        }
+        if (!child_setup_fds(plan)) {
+            perror("dup2");
+            _exit(1);
+        }
+        apply_assignments(cmd, NULL);
+        int status = execute_builtin(cmd);
+        flush_output();
+        _exit(status);
+    }
+
+    if (report[0] >= 0) {
+        close(report[1]);
+        await_child_exec(cmd->args[0], report[0]);
+    }
+    return pid;
+}
+
+/*
+ * Launch external command using the selected launch backend
+ * plan describes the child's stdin/stdout and redirections
+ * Demonstrates core process management concepts
+ * Returns: child pid, or -1 if nothing was started (error already printed)
+ */
+static pid_t execute_external(Command *cmd, const FdPlan *plan) {
+    uint64_t started = monotonic_ns();
+    const char *path = lookup_command(cmd->args[0]);
+    uint64_t resolved = monotonic_ns();
+
+    shell_counters.lookup_ns += resolved - started;
+
+    if (path == NULL) {
+        fprintf(stderr, COLOR_ERROR "%s: command not found\n" COLOR_RESET,
+                cmd->args[0]);
+        return -1;
+    }
+
+    pid_t pid = spawn_resolved(cmd, path, plan);
+
+    // Only a started child is a launch; a failed spawn is not.
+    if (pid > 0) {
+        shell_counters.spawn_ns += monotonic_ns() - resolved;
+        shell_counters.launches++;
+    }
+    return pid;
+}
+
+/*
+ * Launch cmd from its resolved path with the selected backend
+ * With posix_spawn the parent resumes only once the child has exec'd,
+ * so the time spent here is the full shell-side launch cost.
+ */
+static pid_t spawn_resolved(Command *cmd, const char *path, const FdPlan *plan) {
+    pid_t pid;
+
+    if (cmd->limits != NULL) {
+        return spawn_limited(cmd, path, plan);
+    }
+    if (spawn_backend == SPAWN_BACKEND_POSIX_SPAWN) {
+        pid = spawn_with_posix_spawn(cmd, path, plan);
+        if (pid < 0 && errno == ENOENT && path != cmd->args[0]) {
+            // The cached binary vanished; re-resolve once before giving up.
+            path_cache_forget(cmd->args[0]);
+            path = lookup_command(cmd->args[0]);
+            if (path != NULL) {
+                pid = spawn_with_posix_spawn(cmd, path, plan);
+            }
+        }
+        if (pid < 0 && errno == ENOEXEC) {
+            // No #! line: run it as a sh script, as execvp() would.
+            pid = spawn_sh_script(cmd, path, plan);
+        }
+        if (pid < 0) {
+            report_exec_failure(cmd->args[0], path == NULL ? ENOENT : errno);
+        }
+        return pid;
+    }
+
+    return spawn_with_fork(cmd, path, plan);
+}
+
+/*
+ * Start one stage as a child process, builtin or external
+ * Returns: child pid, or -1 if nothing was started (error already printed)
+ */
+static pid_t launch_stage(Command *cmd, const FdPlan *plan) {
+    if (is_builtin(cmd->args[0])) {
+        return spawn_builtin_stage(cmd, plan);
+    }
+    return execute_external(cmd, plan);
+}
+
+/*
+ * Convert a waitpid() status into a shell exit code
+ */
+static int exit_code_from_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/*
+ * Add a reaped child's rusage to the shell counters
+ */
+static void account_child_usage(const struct rusage *usage) {
+    timeradd(&shell_counters.child_utime, &usage->ru_utime, &shell_counters.child_utime);
+    timeradd(&shell_counters.child_stime, &usage->ru_stime, &shell_counters.child_stime);
+    if (usage->ru_maxrss > shell_counters.child_maxrss) {
+        shell_counters.child_maxrss = usage->ru_maxrss;
+    }
+    shell_counters.child_nvcsw += usage->ru_nvcsw;
+    shell_counters.child_nivcsw += usage->ru_nivcsw;
+}
+
+/*
+ * Wait for every process of a foreground pipeline
+ * Returns: exit code of the last stage
+ */
+static int wait_pipeline(const pid_t *pids, int count, int last_code) {
+    int code = last_code;
+    uint64_t started = monotonic_ns();
+
+    for (int i = 0; i < count; i++) {
+        int status;
+        pid_t wait_result;
+
+        if (pids[i] < 0) {
+            continue;
+        }
+
+        struct rusage usage;
+        do {
+            wait_result = wait4(pids[i], &status, 0, &usage);
+        } while (wait_result == -1 && errno == EINTR);
+
+        if (wait_result == -1) {
+            perror("wait4");
+            if (i == count - 1) {
+                code = 1;
+            }
+            continue;
+        }
+
+        account_child_usage(&usage);
+        if (i == count - 1) {
+            code = exit_code_from_status(status);
+        }
+    }
+    shell_counters.wait_ns += monotonic_ns() - started;
+    return code;
+}
+
+/*
+ * Execute a command list left to right in the shell process
+ * Each pipeline runs or is skipped according to the connector before it
+ * and the status so far; a skipped pipeline leaves the status unchanged,
+ * so "a && b || c" runs c when either a or b fails.
+ * Returns: Status of the last pipeline that ran
+ */
+static int execute_list(Pipeline *list) {
+    int status = 0;
+    Connector join = CONNECT_SEQ;
+
+    for (Pipeline *pipeline = list; pipeline != NULL; pipeline = pipeline->next) {
+        bool run = join == CONNECT_SEQ
+                   || (join == CONNECT_AND && status == 0)
+                   || (join == CONNECT_OR && status != 0);
+
+        if (run && pipeline->nstages > 0) {
+            Pipeline *expanded = expand_pipeline(pipeline);
+            if (expanded == NULL) {
+                status = 1;
+            } else {
+                status = trace_ring.enabled ? execute_traced(expanded)
+                         : option_timing ? execute_timed(expanded)
+                         : execute_command(expanded);
+            }
+            last_status = status;
+        }
+        join = pipeline->connector;
+    }
+    return status;
+}
+
+/*
+ * Execute a pipeline - single builtins run in the shell, everything
+ * else is launched stage by stage before any of them is waited on
+ */
+static int execute_command(Pipeline *pipeline) {
+    if (pipeline->nstages == 0) {
+        return 0;
+    }
+
+    Command *cmd = pipeline->first;
+
+    // "time" at the head of a pipeline times the whole pipeline.
+    // The pipeline may be cached, so strip the keyword from copies.
+    if (cmd->argc > 0 && strcmp(cmd->args[0], "time") == 0) {
+        Command head = *cmd;
+        Pipeline timed = *pipeline;
+
+        head.args++;
+        head.argc--;
+        timed.first = &head;
+        return execute_timed(&timed);
+    }
+
+    // A lone builtin must run in the shell process (cd, exit, ...);
+    // its redirections are applied to the shell and undone afterwards.
+    // Under limit it is forked instead, so the caps stay off the shell.
+    // So is cat at a prompt: the shell ignores SIGINT, and Ctrl-C must
+    // still stop a long copy.
+    if (pipeline->nstages == 1 && !pipeline->background && cmd->limits == NULL
+        && (cmd->argc == 0 || (is_builtin(cmd->args[0])
+                               && !(shell_interactive && strcmp(cmd->args[0], "cat") == 0)))) {
+        FdPlan plan;
+        int saved[MAX_REDIRECTS + 2];
+
+        if (!build_fd_plan(cmd, STDIN_FILENO, STDOUT_FILENO, &plan)) {
+            return 1;
+        }
+        if (cmd->argc == 0) {
+            // Bare assignments set shell variables; bare redirections
+            // only create or truncate their files.
+            apply_assignments(cmd, NULL);
+            release_fd_plan(&plan);
+            return 0;
+        }
+        if (!apply_shell_fds(&plan, saved)) {
+            release_fd_plan(&plan);
+            return 1;
+        }
+
+        // NAME=value before a builtin lasts only for that builtin.
+        SavedVar *saved_vars = NULL;
+        if (cmd->nassigns > 0) {
+            saved_vars = arena_alloc(&line_arena, (size_t)cmd->nassigns * sizeof(SavedVar));
+            if (saved_vars != NULL) {
+                apply_assignments(cmd, saved_vars);
+            }
+        }
+        int result = execute_builtin(cmd);
+        if (saved_vars != NULL) {
+            restore_assignments(cmd, saved_vars);
+        }
+        restore_shell_fds(&plan, saved);
+        release_fd_plan(&plan);
+        return result;
+    }
+
+    // Children must not inherit (and later re-flush) buffered output.
+    flush_output();
+
+    pid_t *pids = malloc((size_t)pipeline->nstages * sizeof(pid_t));
+    if (pids == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int in_fd = STDIN_FILENO;
+    int last_code = 0;
+    int i = 0;
+
+    for (; cmd != NULL; cmd = cmd->next, i++) {
+        int pipe_fds[2] = { -1, STDOUT_FILENO };
+
+        if (cmd->next != NULL && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            pipe_fds[0] = -1;
+            pipe_fds[1] = STDOUT_FILENO;
+            last_code = 1;
+            pids[i] = -1;
+            break;
+        }
+
+        FdPlan plan;
+        if (!build_fd_plan(cmd, in_fd, pipe_fds[1], &plan)) {
+            pids[i] = -1;
+            if (cmd->next == NULL) {
+                last_code = 1;
+            }
+        } else if (cmd->argc == 0) {
+            pids[i] = -1;
+        } else {
+            launch_status = 127;
+            pids[i] = launch_stage(cmd, &plan);
+            if (pids[i] < 0 && cmd->next == NULL) {
+                last_code = launch_status;
+            } else if (pids[i] > 0) {
+                shell_counters.last_pid = pids[i];
+            }
+        }
+        release_fd_plan(&plan);
+
+        // The parent keeps only the read end for the next stage.
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (pipe_fds[1] != STDOUT_FILENO) {
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+    }
+    if (in_fd != STDIN_FILENO && in_fd >= 0) {
+        close(in_fd);
+    }
+
+    int code = 0;
+    if (!pipeline->background) {
+        // Foreground: reap every stage together
+        code = wait_pipeline(pids, i, last_code);
+    } else {
+        // Background: record the job and don't wait
+        Job *job = job_add(pipeline, pids, i);
+        if (job != NULL && shell_interactive) {
+            printf("[%d] %d\n", job->id, (int)job->pids[job->npids - 1]);
+            fflush(stdout);
+        }
+    }
+
+    free(pids);
+    return code;
+}
+
+/*
+ * Add a builtin to the dispatch table
+ * A later registration with the same name replaces the earlier one.
+ * Returns: false if the table is full
+ */
+static bool register_builtin(const BuiltinDef *def) {
+    size_t slot = hash_string(def->name) & (BUILTIN_INDEX_SIZE - 1);
+
+    while (builtin_index[slot] != NULL) {
+        if (strcmp(builtin_index[slot]->name, def->name) == 0) {
+            for (size_t i = 0; i < builtin_count; i++) {
+                if (builtin_registry[i] == builtin_index[slot]) {
+                    builtin_registry[i] = def;
+                }
+            }
+            builtin_index[slot] = def;
+            return true;
+        }
+        slot = (slot + 1) & (BUILTIN_INDEX_SIZE - 1);
+    }
+
+    if (builtin_count == MAX_BUILTINS) {
+        fprintf(stderr, COLOR_ERROR "%s: too many builtins\n" COLOR_RESET, def->name);
+        return false;
+    }
+    builtin_index[slot] = def;
+    builtin_registry[builtin_count++] = def;
+    return true;
+}
+
+/*
+ * Look up a builtin by name, registering the core set on first use
+ * Returns: Registry entry, or NULL if name is not a builtin
+ */
+static const BuiltinDef *find_builtin(const char *name) {
+    if (!builtins_ready) {
+        builtins_ready = true;
+        uint64_t start = startup_trace ? monotonic_ns() : 0;
+        for (size_t i = 0; i < sizeof(core_builtins) / sizeof(core_builtins[0]); i++) {
+            register_builtin(&core_builtins[i]);
+        }
+        startup_lazy("builtins", start);
+    }
+
+    size_t slot = hash_string(name) & (BUILTIN_INDEX_SIZE - 1);
+    while (builtin_index[slot] != NULL) {
+        if (strcmp(builtin_index[slot]->name, name) == 0) {
+            return builtin_index[slot];
+        }
+        slot = (slot + 1) & (BUILTIN_INDEX_SIZE - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Build the "a | b" text of a pipeline for job listings
+ * Returns: Dynamically allocated string, or NULL on allocation failure
+ */
+static char *pipeline_text(Pipeline *pipeline) {
+    size_t len = 1;
+
+    for (Command *cmd = pipeline->first; cmd; cmd = cmd->next) {
+        for (int i = 0; i < cmd->argc; i++) {
+            len += strlen(cmd->args[i]) + 1;
+        }
+        len += 3;
+    }
+
+    char *text = malloc(len);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    char *out = text;
+    for (Command *cmd = pipeline->first; cmd; cmd = cmd->next) {
+        for (int i = 0; i < cmd->argc; i++) {
+            size_t n = strlen(cmd->args[i]);
+            memcpy(out, cmd->args[i], n);
+            out += n;
+            *out++ = ' ';
+        }
+        if (cmd->next != NULL) {
+            memcpy(out, "| ", 2);
+            out += 2;
+        }
+    }
+    if (out > text) {
+        out--;
+    }
+    *out = '\0';
+    return text;
+}
+
+/*
+ * Release a job's storage and drop it from the table (keeps order)
+ */
+static void job_remove(size_t index) {
+    Job *job = &job_table.jobs[index];
+
+    free(job->pids);
+    free(job->command);
+    memmove(job, job + 1, (job_table.count - index - 1) * sizeof(Job));
+    job_table.count--;
+}
+
+/*
+ * Record a background pipeline in the job table
+ * Returns: The new job, or NULL if nothing was launched / out of memory
+ */
+static Job *job_add(Pipeline *pipeline, const pid_t *pids, int count) {
+    int launched = 0;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] > 0) {
+            launched++;
+        }
+    }
+    if (launched == 0) {
+        return NULL;
+    }
+
+    // Forget the oldest finished jobs nobody asked about.
+    size_t done = 0;
+    for (size_t i = 0; i < job_table.count; i++) {
+        done += job_table.jobs[i].done;
+    }
+    for (size_t i = 0; done >= MAX_DONE_JOBS && i < job_table.count; ) {
+        if (job_table.jobs[i].done) {
+            job_remove(i);
+            done--;
+        } else {
+            i++;
+        }
+    }
+
+    if (job_table.count == job_table.capacity) {
+        size_t capacity = job_table.capacity ? job_table.capacity * 2 : 16;
+        Job *grown = realloc(job_table.jobs, capacity * sizeof(Job));
+        if (grown == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        job_table.jobs = grown;
+        job_table.capacity = capacity;
+    }
+
+    Job *job = &job_table.jobs[job_table.count];
+    memset(job, 0, sizeof(*job));
+    job->pids = malloc((size_t)launched * sizeof(pid_t));
+    if (job->pids == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pids[i] > 0) {
+            job->pids[job->npids++] = pids[i];
+        }
+    }
+    job->nlive = job->npids;
+    job->command = pipeline_text(pipeline);
+    job->id = job_table.count > 0 ? job_table.jobs[job_table.count - 1].id + 1 : 1;
+    job_table.count++;
+    return job;
+}
+
+/*
+ * Record a reaped process against its job
+ */
+static void job_record_exit(Job *job, int index, int status) {
+    // The job's status is that of its last stage, as for a foreground pipeline.
+    if (index == job->npids - 1) {
+        job->status = exit_code_from_status(status);
+    }
+    job->pids[index] = -job->pids[index];
+    if (--job->nlive == 0) {
+        job->done = true;
+    }
+}
+
+/*
+ * Find the live job process with the given pid
+ */
+static Job *job_find_pid(pid_t pid, int *index) {
+    for (size_t i = 0; i < job_table.count; i++) {
+        Job *job = &job_table.jobs[i];
+        for (int j = 0; !job->done && j < job->npids; j++) {
+            if (job->pids[j] == pid) {
+                *index = j;
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reap finished background processes
+ * Called from the main loop, never from the signal handler. waitid()
+ * with WNOWAIT peeks at the next zombie so only job pids are collected;
+ * anything else is left for whoever is waiting on it.
+ */
+static void reap_jobs(void) {
+    char drain[64];
+
+    if (sigchld_pipe[0] >= 0) {
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+    if (job_table.count == 0) {
+        return;
+    }
+
+    while (true) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0) {
+            return;
+        }
+
+        int index;
+        Job *job = job_find_pid(info.si_pid, &index);
+        if (job == NULL) {
+            break;
+        }
+
+        int status;
+        if (waitpid(info.si_pid, &status, 0) == info.si_pid) {
+            job_record_exit(job, index, status);
+        }
+    }
+
+    // The next zombie is not ours; check each job pid individually.
+    for (size_t i = 0; i < job_table.count; i++) {
+        Job *job = &job_table.jobs[i];
+        for (int j = 0; !job->done && j < job->npids; j++) {
+            int status;
+            if (job->pids[j] > 0 && waitpid(job->pids[j], &status, WNOHANG) == job->pids[j]) {
+                job_record_exit(job, j, status);
+            }
+        }
+    }
+}
+
+/*
+ * Print one job line for jobs and completion notices
+ */
+static void print_job(const Job *job, bool with_pids) {
+    char state[32];
+
+    if (!job->done) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (job->status == 0) {
+        snprintf(state, sizeof(state), "Done");
+    } else {
+        snprintf(state, sizeof(state), "Exit %d", job->status);
+    }
+
+    // A running job pinned away from the shell's CPUs shows where it runs.
+    char where[336] = "";
+    for (int i = job->npids - 1; i >= 0 && !job->done; i--) {
+        cpu_set_t cpus;
+        if (job->pids[i] <= 0 || sched_getaffinity(job->pids[i], sizeof(cpus), &cpus) != 0) {
+            continue;
+        }
+        const CpuTopology *topo = cpu_topology();
+        if (!CPU_EQUAL(&cpus, &topo->allowed)) {
+            int node = -1;
+            for (int n = 0; n < topo->nnodes && topo->nnodes > 1; n++) {
+                cpu_set_t outside;
+                CPU_AND(&outside, &cpus, &topo->node_cpus[n]);
+                if (CPU_EQUAL(&outside, &cpus)) {
+                    node = topo->node_id[n];
+                    break;
+                }
+            }
+            char place[320];
+            format_placement(&cpus, node, place, sizeof(place));
+            snprintf(where, sizeof(where), "  (%s)", place);
+        }
+        break;
+    }
+
+    out_printf("[%d]  %-10s %s%s\n", job->id, state, job->command ? job->command : "", where);
+    if (with_pids) {
+        for (int i = 0; i < job->npids; i++) {
+            if (job->pids[i] > 0) {
+                out_printf("       %d\n", (int)job->pids[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Check whether any job has finished but not yet been reported
+ */
+static bool jobs_finished(void) {
+    for (size_t i = 0; i < job_table.count; i++) {
+        if (job_table.jobs[i].done) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Report and forget finished jobs (interactive shells, before the prompt)
+ */
+static void notify_jobs(void) {
+    for (size_t i = 0; i < job_table.count; ) {
+        if (job_table.jobs[i].done) {
+            print_job(&job_table.jobs[i], false);
+            job_remove(i);
+        } else {
+            i++;
+        }
+    }
+    out_flush();
+}
+
+/*
+ * Block until every process of a job has been reaped
+ */
+static void job_wait(Job *job) {
+    for (int i = 0; i < job->npids; i++) {
+        if (job->pids[i] <= 0) {
+            continue;
+        }
+
+        int status;
+        pid_t wait_result;
+        do {
+            wait_result = waitpid(job->pids[i], &status, 0);
+        } while (wait_result == -1 && errno == EINTR);
+
+        if (wait_result == job->pids[i]) {
+            job_record_exit(job, i, status);
+        } else {
+            // Already gone (ECHILD): count it as reaped with unknown status.
+            job->pids[i] = -job->pids[i];
+            if (--job->nlive == 0) {
+                job->done = true;
+            }
+        }
+    }
+}
+
+/*
+ * Resolve a %n or pid operand to a job table index
+ * Returns: index, or -1 if no such job
+ */
+static ssize_t job_lookup(const char *spec) {
+    bool by_id = spec[0] == '%';
+    char *end;
+    long value = strtol(by_id ? spec + 1 : spec, &end, 10);
+
+    if (*end != '\0' || end == (by_id ? spec + 1 : spec)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < job_table.count; i++) {
+        Job *job = &job_table.jobs[i];
+        if (by_id && job->id == value) {
+            return (ssize_t)i;
+        }
+        for (int j = 0; !by_id && j < job->npids; j++) {
+            if (value > 0 && (job->pids[j] == (pid_t)value || job->pids[j] == -(pid_t)value)) {
+                return (ssize_t)i;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Check whether a command name is one of the shell builtins
+ */
+static bool is_builtin(const char *name) {
+    return find_builtin(name) != NULL;
+}
+
+/*
+ * Execute builtin commands (must run in shell process)
+ * Returns: builtin exit status, or -1 if the command is not a builtin
+ */
+static int execute_builtin(Command *cmd) {
+    const BuiltinDef *def = find_builtin(cmd->args[0]);
+
+    if (def == NULL) {
+        return -1;  // Not a builtin
+    }
+    return def->handler(cmd);
+}
+
+/*
+ * cd builtin - change directory (default $HOME)
+ */
+static int builtin_cd(Command *cmd) {
+    const char *path = (cmd->argc > 1) ? cmd->args[1] : var_get("HOME");
+
+    if (path == NULL) {
+        fprintf(stderr, COLOR_ERROR "cd: HOME not set\n" COLOR_RESET);
+        return 1;
+    }
+
+    if (chdir(path) != 0) {
+        perror("cd");
+        return 1;
+    }
+
+    if (shell_cwd != NULL) {
+        var_set("OLDPWD", shell_cwd, true);
+    }
+
+    // getcwd() can fail (e.g. an unreadable parent); then keep an
+    // absolute target as given rather than losing track entirely.
+    const char *cwd = current_directory();
+    set_shell_cwd(cwd != NULL ? cwd : (path[0] == '/' ? path : NULL));
+    return 0;
+}
+
+/*
+ * exit builtin - terminate shell
+ */
+static int builtin_exit(Command *cmd) {
+    int exit_code = (cmd->argc > 1) ? atoi(cmd->args[1]) : 0;
+    flush_output();
+    exit(exit_code);
+}
+
+/*
+ * help builtin - display help information from the builtin registry
+ */
+static int builtin_help(Command *cmd) {
+    (void)cmd;
+
+    // Make sure the registry is populated even if help is looked up first.
+    find_builtin("help");
+
+    out_printf("\nModern C Shell - Available Commands:\n");
+    for (size_t i = 0; i < builtin_count; i++) {
+        out_printf("  %-12s - %s\n", builtin_registry[i]->synopsis,
+                   builtin_registry[i]->summary);
+    }
+    out_printf("  <command> &  - Run command in background\n");
+    out_printf("  a | b | c    - Connect commands with pipes\n");
+    out_printf("  < > >> n>&m  - Redirect input and output\n");
+    out_printf("\nAny other command will be executed as an external program.\n\n");
+    return 0;
+}
+
+/*
+ * history builtin
+ *   history          - list every entry with its number
+ *   history n        - list the newest n entries
+ *   history -s text  - list entries containing text, newest first
+ */
+static int builtin_history(Command *cmd) {
+    if (!history_init()) {
+        fprintf(stderr, COLOR_ERROR "history: not available\n" COLOR_RESET);
+        return 1;
+    }
+    history_refresh();
+
+    if (cmd->argc > 1 && strcmp(cmd->args[1], "-s") == 0) {
+        if (cmd->argc != 3) {
+            fprintf(stderr, COLOR_ERROR "history: usage: history -s text\n" COLOR_RESET);
+            return 2;
+        }
+        long found = 0;
+        for (long i = history_search(cmd->args[2], -1); i >= 0;
+             i = history_search(cmd->args[2], i)) {
+            size_t len;
+            const char *text = history_entry((size_t)i, &len);
+            out_printf("%5ld  %.*s\n", i + 1, (int)len, text);
+            found++;
+        }
+        return found > 0 ? 0 : 1;
+    }
+
+    size_t first = 0;
+    if (cmd->argc > 1) {
+        char *end;
+        long n = strtol(cmd->args[1], &end, 10);
+        if (*end != '\0' || n < 0) {
+            fprintf(stderr, COLOR_ERROR "history: %s: numeric argument required\n" COLOR_RESET,
+                    cmd->args[1]);
+            return 2;
+        }
+        first = (size_t)n < history.count ? history.count - (size_t)n : 0;
+    }
+    for (size_t i = first; i < history.count; i++) {
+        size_t len;
+        const char *text = history_entry(i, &len);
+        out_printf("%5zu  %.*s\n", i + 1, (int)len, text);
+    }
+    return 0;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * export builtin
+ *   export [-p]          - list exported variables
+ *   export name[=value]  - set (optionally) and export variables
+ */
+static int builtin_export(Command *cmd) {
+    int status = 0;
+
+    if (cmd->argc == 1 || (cmd->argc == 2 && strcmp(cmd->args[1], "-p") == 0)) {
+        char **envp = var_envp();
+        size_t n = var_store.nexported;
+        char **sorted = malloc((n + 1) * sizeof(char *));
+        if (sorted == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(sorted, envp, n * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), compare_strings);
+        for (size_t i = 0; i < n; i++) {
+            const char *eq = strchr(sorted[i], '=');
+            out_printf("export %.*s=\"%s\"\n", (int)(eq - sorted[i]), sorted[i], eq + 1);
+        }
+        free(sorted);
+        return 0;
+    }
+
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->args[i];
+        const char *eq = strchr(arg, '=');
+        size_t name_len = eq != NULL ? (size_t)(eq - arg) : strlen(arg);
+
+        if (!valid_name(arg, name_len)) {
+            fprintf(stderr, COLOR_ERROR "export: '%s': not a valid identifier\n" COLOR_RESET,
+                    arg);
+            status = 1;
+        } else if (eq != NULL) {
+            var_assign(arg, true);
+        } else {
+            const char *value = var_get(arg);
+            if (value != NULL) {
+                // Re-store the current value with the export flag set.
+                var_set(arg, value, true);
+            }
+        }
+    }
+    return status;
+}
+
+/*
+ * unset builtin - remove variables
+ */
+static int builtin_unset(Command *cmd) {
+    int status = 0;
+
+    for (int i = 1; i < cmd->argc; i++) {
+        if (!valid_name(cmd->args[i], strlen(cmd->args[i]))) {
+            fprintf(stderr, COLOR_ERROR "unset: '%s': not a valid identifier\n" COLOR_RESET,
+                    cmd->args[i]);
+            status = 1;
+            continue;
+        }
+        var_unset(cmd->args[i]);
+    }
+    return status;
+}
+
+/*
+ * fds builtin - list the shell's open descriptors
+ * Shows access mode, whether the descriptor survives exec, and what it
+ * refers to. "inherit" above the inherited range is a leak.
+ */
+static int builtin_fds(Command *cmd) {
+    (void)cmd;
+    int highest = highest_open_fd();
+    if (highest < 0) {
+        // No /proc: probe a conventional range instead.
+        highest = 255;
+    }
+
+    for (int fd = 0; fd <= highest; fd++) {
+        int fd_flags = fcntl(fd, F_GETFD);
+        if (fd_flags == -1) {
+            continue;
+        }
+
+        int fl = fcntl(fd, F_GETFL);
+        const char *mode = (fl & O_ACCMODE) == O_RDONLY ? "r"
+                         : (fl & O_ACCMODE) == O_WRONLY ? "w" : "rw";
+
+        char link[64];
+        char target[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(link, target, sizeof(target) - 1);
+        target[len > 0 ? len : 0] = '\0';
+
+        out_printf("%3d  %-2s  %-7s  %s\n", fd, mode,
+                   (fd_flags & FD_CLOEXEC) ? "cloexec" : "inherit", len > 0 ? target : "?");
+    }
+    if (inherited_fd_end >= 0) {
+        out_printf("inherited: 0-%d\n", inherited_fd_end - 1);
+    }
+    return 0;
+}
+
+/*
+ * pwd builtin - print working directory
+ */
+static int builtin_pwd(Command *cmd) {
+    (void)cmd;
+    vars_init();
+    const char *cwd = shell_cwd != NULL ? shell_cwd : current_directory();
+
+    if (cwd != NULL) {
+        out_printf("%s\n", cwd);
+        return 0;
+    }
+    perror("pwd");
+    return 1;
+}
+
+/*
+ * Write everything in data to fd 1, retrying short writes
+ */
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;     // EPIPE, EBADF...: output is discarded like stdio does
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * Append bytes to the builtin output buffer
+ */
+static void out_write(const char *data, size_t len) {
+    if (out_buf.len + len > OUT_BUFFER_SIZE) {
+        out_flush();
+        if (len > OUT_BUFFER_SIZE) {
+            write_all(data, len);
+            return;
+        }
+    }
+    memcpy(out_buf.data + out_buf.len, data, len);
+    out_buf.len += len;
+}
+
+/*
+ * Append a single byte to the builtin output buffer
+ */
+static void out_putc(char c) {
+    if (out_buf.len == OUT_BUFFER_SIZE) {
+        out_flush();
+    }
+    out_buf.data[out_buf.len++] = c;
+}
+
+/*
+ * printf into the builtin output buffer
+ */
+static void out_printf(const char *fmt, ...) {
+    va_list ap;
+    size_t room = OUT_BUFFER_SIZE - out_buf.len;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(out_buf.data + out_buf.len, room, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < room) {
+        out_buf.len += (size_t)n;
+        return;
+    }
+
+    // Did not fit: flush, then format again (into the heap if still too big).
+    out_flush();
+    if ((size_t)n < OUT_BUFFER_SIZE) {
+        va_start(ap, fmt);
+        vsnprintf(out_buf.data, OUT_BUFFER_SIZE, fmt, ap);
+        va_end(ap);
+        out_buf.len = (size_t)n;
+        return;
+    }
+
+    char *big = malloc((size_t)n + 1);
+    if (big == NULL) {
+        perror("malloc");
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    write_all(big, (size_t)n);
+    free(big);
+}
+
+/*
+ * Write out the builtin output buffer
+ */
+static void out_flush(void) {
+    if (out_buf.len > 0) {
+        write_all(out_buf.data, out_buf.len);
+        out_buf.len = 0;
+    }
+}
+
+/*
+ * Flush both the builtin buffer and stdio at a command boundary
+ */
+static void flush_output(void) {
+    out_flush();
+    fflush(stdout);
+}
+
+/*
+ * true/false builtins
+ */
+static int builtin_true(Command *cmd) {
+    (void)cmd;
+    return 0;
+}
+
+static int builtin_false(Command *cmd) {
+    (void)cmd;
+    return 1;
+}
+
+/*
+ * Emit one backslash escape starting at *p (just past the backslash)
+ * Handles \a \b \e \f \n \r \t \v \\ \0nnn (echo) or \nnn (printf), \xHH
+ * Returns: false for \c, which stops all further output
+ */
+static bool out_escape(const char **p, bool echo_octal) {
+    const char *s = *p;
+    int value;
+
+    switch (*s) {
+    case 'a': out_putc('\a'); break;
+    case 'b': out_putc('\b'); break;
+    case 'c': *p = s + 1; return false;
+    case 'e': out_putc('\033'); break;
+    case 'f': out_putc('\f'); break;
+    case 'n': out_putc('\n'); break;
+    case 'r': out_putc('\r'); break;
+    case 't': out_putc('\t'); break;
+    case 'v': out_putc('\v'); break;
+    case '\\': out_putc('\\'); break;
+    case 'x':
+        value = 0;
+        int digits = 0;
+        while (digits < 2 && isxdigit((unsigned char)s[1])) {
+            s++;
+            value = value * 16 + (isdigit((unsigned char)*s) ? *s - '0'
+                                                             : (tolower((unsigned char)*s) - 'a' + 10));
+            digits++;
+        }
+        if (digits == 0) {
+            out_write("\\x", 2);
+        } else {
+            out_putc((char)value);
+        }
+        break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7':
+        // echo spells octal as \0nnn; printf as \nnn.
+        if (echo_octal && *s != '0') {
+            out_putc('\\');
+            out_putc(*s);
+            break;
+        }
+        value = 0;
+        int max = (echo_octal ? 4 : 3);
+        for (int n = 0; n < max && *s >= '0' && *s <= '7'; n++, s++) {
+            value = value * 8 + (*s - '0');
+        }
+        s--;
+        out_putc((char)value);
+        break;
+    case '\0':
+        out_putc('\\');
+        *p = s;
+        return true;
+    default:
+        out_putc('\\');
+        out_putc(*s);
+        break;
+    }
+    *p = s + 1;
+    return true;
+}
+
+/*
+ * echo builtin
+ *   echo [-neE] [arg...]  - -n: no newline, -e: interpret escapes, -E: don't
+ */
+static int builtin_echo(Command *cmd) {
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+
+    // Options are only recognised while every letter is one of n, e, E.
+    for (; i < cmd->argc && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        const char *opt = cmd->args[i] + 1;
+        if (strspn(opt, "neE") != strlen(opt)) {
+            break;
+        }
+        for (; *opt; opt++) {
+            if (*opt == 'n') {
+                newline = false;
+            } else if (*opt == 'e') {
+                escapes = true;
+            } else {
+                escapes = false;
+            }
+        }
+    }
+
+    for (; i < cmd->argc; i++) {
+        const char *arg = cmd->args[i];
+
+        if (!escapes || strchr(arg, '\\') == NULL) {
+            out_write(arg, strlen(arg));
+        } else {
+            while (*arg) {
+                if (*arg != '\\') {
+                    out_putc(*arg++);
+                    continue;
+                }
+                arg++;
+                if (!out_escape(&arg, true)) {
+                    return 0;
+                }
+            }
+        }
+        if (i + 1 < cmd->argc) {
+            out_putc(' ');
+        }
+    }
+
+    if (newline) {
+        out_putc('\n');
+    }
+    return 0;
+}
+
+/*
+ * Convert a printf numeric argument; 'c and "c give the character code
+ * Returns: false (after reporting) if the argument is not a valid number
+ */
+static bool printf_number(const char *arg, bool is_signed, long long *value) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return true;
+    }
+    if (*arg == '\0') {
+        *value = 0;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    *value = is_signed ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+    if (*end != '\0' || errno == ERANGE) {
+        fprintf(stderr, COLOR_ERROR "printf: %s: invalid number\n" COLOR_RESET, arg);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * printf builtin
+ *   printf format [arg...]  - reuses the format until all args are consumed
+ * Supports flags/width/precision (including *) and %d %i %o %u %x %X
+ * %c %s %b %e %E %f %F %g %G %%, plus backslash escapes in the format.
+ */
+static int builtin_printf(Command *cmd) {
+    if (cmd->argc < 2) {
+        fprintf(stderr, COLOR_ERROR "printf: usage: printf format [arguments]\n" COLOR_RESET);
+        return 2;
+    }
+
+    const char *format = cmd->args[1];
+    int argi = 2;
+    int status = 0;
+
+    do {
+        int first_arg = argi;
+
+        for (const char *f = format; *f; ) {
+            if (*f == '\\') {
+                f++;
+                if (!out_escape(&f, false)) {
+                    return status;
+                }
+                continue;
+            }
+            if (*f != '%') {
+                const char *run = f;
+                while (*f && *f != '%' && *f != '\\') {
+                    f++;
+                }
+                out_write(run, (size_t)(f - run));
+                continue;
+            }
+            if (f[1] == '%') {
+                out_putc('%');
+                f += 2;
+                continue;
+            }
+
+            // Copy the conversion spec, resolving '*' from the arguments.
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f && strchr("-+ #0", *f) && n < 20) {
+                spec[n++] = *f++;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*f != '.') {
+                        break;
+                    }
+                    spec[n++] = *f++;
+                }
+                if (*f == '*') {
+                    long long star = 0;
+                    if (argi < cmd->argc && !printf_number(cmd->args[argi++], true, &star)) {
+                        status = 1;
+                    }
+                    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%d", (int)star);
+                    f++;
+                } else {
+                    while (isdigit((unsigned char)*f) && n < 40) {
+                        spec[n++] = *f++;
+                    }
+                }
+            }
+
+            char conv = *f;
+            if (conv == '\0' || strchr("diouxXcsbeEfFgG", conv) == NULL) {
+                fprintf(stderr, COLOR_ERROR "printf: %%%c: invalid conversion\n" COLOR_RESET,
+                        conv ? conv : ' ');
+                return 1;
+            }
+            f++;
+
+            const char *arg = argi < cmd->argc ? cmd->args[argi++] : NULL;
+            long long number;
+
+            switch (conv) {
+            case 'd': case 'i':
+                if (!printf_number(arg ? arg : "", true, &number)) {
+                    status = 1;
+                }
+                memcpy(spec + n, "lld", 4);
+                out_printf(spec, number);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                if (!printf_number(arg ? arg : "", false, &number)) {
+                    status = 1;
+                }
+                spec[n] = 'l';
+                spec[n + 1] = 'l';
+                spec[n + 2] = conv;
+                spec[n + 3] = '\0';
+                out_printf(spec, (unsigned long long)number);
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                double real = 0.0;
+                if (arg != NULL && *arg) {
+                    char *end;
+                    real = strtod(arg, &end);
+                    if (*end != '\0') {
+                        fprintf(stderr, COLOR_ERROR "printf: %s: invalid number\n" COLOR_RESET,
+                                arg);
+                        status = 1;
+                    }
+                }
+                spec[n] = conv;
+                spec[n + 1] = '\0';
+                out_printf(spec, real);
+                break;
+            }
+            case 'c':
+                // An empty argument has no character to print; still
+                // honour the width, but never emit a NUL byte.
+                spec[n + 1] = '\0';
+                if (arg && *arg) {
+                    spec[n] = 'c';
+                    out_printf(spec, *arg);
+                } else {
+                    spec[n] = 's';
+                    out_printf(spec, "");
+                }
+                break;
+            case 's':
+                spec[n] = 's';
+                spec[n + 1] = '\0';
+                out_printf(spec, arg ? arg : "");
+                break;
+            case 'b':
+                // %b expands escapes in the argument; width is ignored.
+                for (const char *b = arg ? arg : ""; *b; ) {
+                    if (*b != '\\') {
+                        out_putc(*b++);
+                        continue;
+                    }
+                    b++;
+                    if (!out_escape(&b, true)) {
+                        return status;
+                    }
+                }
+                break;
+            }
+        }
+
+        // Stop once a pass consumed nothing (format without conversions).
+        if (argi == first_arg) {
+            break;
+        }
+    } while (argi < cmd->argc);
+
+    return status;
+}
+
+// Cursor over test/[ operands for the recursive-descent evaluator.
+typedef struct {
+    char **argv;
+    int pos;
+    int end;
+    bool error;
+} TestParser;
+
+/*
+ * Report a test syntax error once and mark the parse as failed
+ */
+static bool test_error(TestParser *tp, const char *msg, const char *arg) {
+    if (!tp->error) {
+        if (arg != NULL) {
+            fprintf(stderr, COLOR_ERROR "test: %s: %s\n" COLOR_RESET, arg, msg);
+        } else {
+            fprintf(stderr, COLOR_ERROR "test: %s\n" COLOR_RESET, msg);
+        }
+    }
+    tp->error = true;
+    return false;
+}
+
+static bool test_is_binary_op(const char *op) {
+    static const char *const ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef",
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool test_is_unary_op(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0'
+        && strchr("bcdefghknprstuwxzGLOS", op[1]) != NULL;
+}
+
+/*
+ * Parse a test integer operand
+ */
+static bool test_integer(TestParser *tp, const char *arg, long long *value) {
+    char *end;
+
+    errno = 0;
+    while (isspace((unsigned char)*arg)) {
+        arg++;
+    }
+    *value = strtoll(arg, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (*arg == '\0' || *end != '\0' || errno == ERANGE) {
+        return test_error(tp, "integer expression expected", arg);
+    }
+    return true;
+}
+
+/*
+ * Evaluate a unary file or string primary such as -f path or -n str
+ */
+static bool test_unary(TestParser *tp, char op, const char *arg) {
+    struct stat st;
+
+    switch (op) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': {
+        long long fd;
+        return test_integer(tp, arg, &fd) && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+    }
+    case 'h': case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return true;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'G': return st.st_gid == getegid();
+    case 'O': return st.st_uid == geteuid();
+    case 'S': return S_ISSOCK(st.st_mode);
+    }
+    return false;
+}
+
+/*
+ * Evaluate a binary primary: string, integer or file comparison
+ */
+static bool test_binary(TestParser *tp, const char *lhs, const char *op, const char *rhs) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(lhs, rhs) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(lhs, rhs) != 0;
+    }
+    if (strcmp(op, "<") == 0) {
+        return strcmp(lhs, rhs) < 0;
+    }
+    if (strcmp(op, ">") == 0) {
+        return strcmp(lhs, rhs) > 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat a, b;
+        bool have_a = stat(lhs, &a) == 0;
+        bool have_b = stat(rhs, &b) == 0;
+
+        if (op[1] == 'e') {
+            return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        if (!have_a || !have_b) {
+            // A missing file is older than any existing one.
+            return op[1] == 'n' ? (have_a && !have_b) : (!have_a && have_b);
+        }
+        bool newer = a.st_mtim.tv_sec > b.st_mtim.tv_sec
+            || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+        bool older = a.st_mtim.tv_sec < b.st_mtim.tv_sec
+            || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec);
+        return op[1] == 'n' ? newer : older;
+    }
+
+    long long a, b;
+    if (!test_integer(tp, lhs, &a) || !test_integer(tp, rhs, &b)) {
+        return false;
+    }
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+static bool test_or(TestParser *tp);
+
+/*
+ * primary := '(' expr ')' | arg binop arg | unop arg | arg
+ */
+static bool test_primary(TestParser *tp) {
+    int left = tp->end - tp->pos;
+
+    if (left <= 0) {
+        return test_error(tp, "argument expected", NULL);
+    }
+
+    char **argv = tp->argv;
+    const char *arg = argv[tp->pos];
+
+    // A binary operator in second position wins over everything else,
+    // so "test ( = (" and "test -f = -f" compare strings.
+    if (left >= 3 && test_is_binary_op(argv[tp->pos + 1])) {
+        tp->pos += 3;
+        return test_binary(tp, arg, argv[tp->pos - 2], argv[tp->pos - 1]);
+    }
+
+    if (strcmp(arg, "(") == 0 && left >= 2) {
+        tp->pos++;
+        bool value = test_or(tp);
+        if (tp->pos >= tp->end || strcmp(argv[tp->pos], ")") != 0) {
+            return test_error(tp, "')' expected", NULL);
+        }
+        tp->pos++;
+        return value;
+    }
+
+    if (left >= 2 && test_is_unary_op(arg)) {
+        tp->pos += 2;
+        return test_unary(tp, arg[1], argv[tp->pos - 1]);
+    }
+
+    // Lone string: true when non-empty.
+    tp->pos++;
+    return arg[0] != '\0';
+}
+
+/*
+ * not := '!' not | primary
+ */
+static bool test_not(TestParser *tp) {
+    if (tp->pos < tp->end - 1 && strcmp(tp->argv[tp->pos], "!") == 0) {
+        tp->pos++;
+        return !test_not(tp);
+    }
+    return test_primary(tp);
+}
+
+/*
+ * and := not ('-a' not)*
+ */
+static bool test_and(TestParser *tp) {
+    bool value = test_not(tp);
+
+    while (tp->pos < tp->end && strcmp(tp->argv[tp->pos], "-a") == 0) {
+        tp->pos++;
+        bool rhs = test_not(tp);
+        value = value && rhs;
+    }
+    return value;
+}
+
+/*
+ * or := and ('-o' and)*
+ */
+static bool test_or(TestParser *tp) {
+    bool value = test_and(tp);
+
+    while (tp->pos < tp->end && strcmp(tp->argv[tp->pos], "-o") == 0) {
+        tp->pos++;
+        bool rhs = test_and(tp);
+        value = value || rhs;
+    }
+    return value;
+}
+
+/*
+ * test / [ builtin
+ *   test expr, [ expr ]  - 0 if true, 1 if false, 2 on syntax errors
+ */
+static int builtin_test(Command *cmd) {
+    TestParser tp = { .argv = cmd->args, .pos = 1, .end = cmd->argc, .error = false };
+
+    if (strcmp(cmd->args[0], "[") == 0) {
+        if (cmd->argc < 2 || strcmp(cmd->args[cmd->argc - 1], "]") != 0) {
+            fprintf(stderr, COLOR_ERROR "[: missing ']'\n" COLOR_RESET);
+            return 2;
+        }
+        tp.end--;
+    }
+
+    // No operands at all is simply false.
+    if (tp.pos >= tp.end) {
+        return 1;
+    }
+
+    bool value = test_or(&tp);
+    if (!tp.error && tp.pos < tp.end) {
+        test_error(&tp, "too many arguments", tp.argv[tp.pos]);
+    }
+    if (tp.error) {
+        return 2;
+    }
+    return value ? 0 : 1;
+}
+
+/*
+ * jobs builtin
+ *   jobs      - list background jobs; finished ones are then forgotten
+ *   jobs -l   - also list each job's process ids
+ *   jobs -p   - print only the process id of each job's last stage
+ */
+static int builtin_jobs(Command *cmd) {
+    bool with_pids = false;
+    bool pids_only = false;
+
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->args[i], "-l") == 0) {
+            with_pids = true;
+        } else if (strcmp(cmd->args[i], "-p") == 0) {
+            pids_only = true;
+        } else {
+            fprintf(stderr, COLOR_ERROR "jobs: %s: invalid option\n" COLOR_RESET,
+                    cmd->args[i]);
+            return 2;
+        }
+    }
+
+    reap_jobs();
+    for (size_t i = 0; i < job_table.count; ) {
+        Job *job = &job_table.jobs[i];
+
+        if (pids_only) {
+            pid_t last = job->pids[job->npids - 1];
+            out_printf("%d\n", (int)(last < 0 ? -last : last));
+        } else {
+            print_job(job, with_pids);
+        }
+
+        if (job->done && !pids_only) {
+            job_remove(i);
+        } else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * wait builtin
+ *   wait            - wait for every background job, return 0
+ *   wait %n|pid...  - wait for the given jobs, return the last one's status
+ */
+static int builtin_wait(Command *cmd) {
+    reap_jobs();
+
+    if (cmd->argc == 1) {
+        while (job_table.count > 0) {
+            job_wait(&job_table.jobs[0]);
+            job_remove(0);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        ssize_t index = job_lookup(cmd->args[i]);
+        if (index < 0) {
+            fprintf(stderr, COLOR_ERROR "wait: %s: no such job\n" COLOR_RESET,
+                    cmd->args[i]);
+            status = 127;
+            continue;
+        }
+        job_wait(&job_table.jobs[index]);
+        status = job_table.jobs[index].status;
+        job_remove((size_t)index);
+    }
+    return status;
+}
+
+// Which finished tasks the parallel runner reports on stderr.
+typedef enum {
+    TASK_REPORT_ALL,
+    TASK_REPORT_FAILURES,   // parallel -q
+    TASK_REPORT_NONE,       // xargs: the exit status alone tells
+} TaskReport;
+
+// One in-flight task of the parallel builtin (or an xargs batch).
+typedef struct {
+    pid_t pid;              // 0 when the slot is free
+    long seq;               // 1-based task number, in input order
+    const char *item;       // Input item (lives in the slot's arena)
+    Arena arena;            // Substituted argv strings for this task
+    ChildLimits placement;  // CPUs and memory node chosen by -P
+} ParallelSlot;
+
+/*
+ * Replace every "{}" in word with item
+ * Returns: Arena string, or NULL on allocation failure
+ */
+static char *parallel_substitute(Arena *arena, const char *word, const char *item) {
+    size_t item_len = strlen(item);
+    size_t len = 0;
+
+    for (const char *p = word; *p; ) {
+        if (p[0] == '{' && p[1] == '}') {
+            len += item_len;
+            p += 2;
+        } else {
+            len++;
+            p++;
+        }
+    }
+
+    char *out = arena_alloc(arena, len + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    char *o = out;
+    for (const char *p = word; *p; ) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(o, item, item_len);
+            o += item_len;
+            p += 2;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/*
+ * Start one task of the parallel builtin in slot
+ * Returns: false if the task could not be launched (already reported)
+ */
+static bool parallel_launch(ParallelSlot *slot, char **tmpl, int tmpl_argc,
+                            const FdPlan *plan, bool placed) {
+    Command task = { .argc = 0, .limits = placed ? &slot->placement : NULL };
+    bool substituted = false;
+
+    // Template words, possibly the item, and the NULL terminator.
+    task.args = arena_alloc(&slot->arena, ((size_t)tmpl_argc + 2) * sizeof(char *));
+    if (task.args == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < tmpl_argc; i++) {
+        if (strstr(tmpl[i], "{}") != NULL) {
+            task.args[task.argc] = parallel_substitute(&slot->arena, tmpl[i], slot->item);
+            if (task.args[task.argc] == NULL) {
+                return false;
+            }
+            substituted = true;
+        } else {
+            task.args[task.argc] = tmpl[i];
+        }
+        task.argc++;
+    }
+
+    // Without a {} placeholder the item becomes the last argument.
+    if (!substituted) {
+        task.args[task.argc++] = (char *)slot->item;
+    }
+    task.args[task.argc] = NULL;
+
+    slot->pid = launch_stage(&task, plan);
+    return slot->pid > 0;
+}
+
+/*
+ * Report one finished task
+ */
+static void parallel_report(const ParallelSlot *slot, int code, TaskReport report) {
+    if (report == TASK_REPORT_NONE || (code == 0 && report == TASK_REPORT_FAILURES)) {
+        return;
+    }
+    const ChildLimits *placement = &slot->placement;
+    if (placement->pin_cpus || placement->bind_memory) {
+        char where[320];
+        format_placement(placement->pin_cpus ? &placement->cpus : NULL,
+                         placement->bind_memory ? placement->mem_node : -1,
+                         where, sizeof(where));
+        fprintf(stderr, "parallel: [%ld] exit %d (%s): %s\n", slot->seq, code, where,
+                slot->item);
+    } else {
+        fprintf(stderr, "parallel: [%ld] exit %d: %s\n", slot->seq, code, slot->item);
+    }
+}
+
+/*
+ * Block until at least one in-flight task exits, and reap all that have
+ * Sleeps on the SIGCHLD self-pipe; only the slots' own pids are waited for.
+ * Returns: number of failed tasks reaped
+ */
+static int parallel_reap(ParallelSlot *slots, long nslots, long *running,
+                         TaskReport report) {
+    int failed = 0;
+
+    while (true) {
+        char drain[64];
+        if (sigchld_pipe[0] >= 0) {
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        bool reaped = false;
+        for (long i = 0; i < nslots; i++) {
+            int status;
+            if (slots[i].pid > 0 && waitpid(slots[i].pid, &status, WNOHANG) == slots[i].pid) {
+                int code = exit_code_from_status(status);
+                parallel_report(&slots[i], code, report);
+                failed += code != 0;
+                slots[i].pid = 0;
+                (*running)--;
+                reaped = true;
+            }
+        }
+        if (reaped) {
+            return failed;
+        }
+
+        if (sigchld_pipe[0] < 0) {
+            // No wakeup channel: block on the first in-flight task instead.
+            for (long i = 0; i < nslots; i++) {
+                int status;
+                if (slots[i].pid > 0 && waitpid(slots[i].pid, &status, 0) == slots[i].pid) {
+                    int code = exit_code_from_status(status);
+                    parallel_report(&slots[i], code, report);
+                    slots[i].pid = 0;
+                    (*running)--;
+                    return code != 0;
+                }
+            }
+            return failed;
+        }
+
+        struct pollfd pfd = { .fd = sigchld_pipe[0], .events = POLLIN };
+        poll(&pfd, 1, -1);
+    }
+}
+
+/*
+ * parallel builtin
+ *   parallel [-j N] [-q] [-P policy] command [arg...] [::: item...]
+ * Runs command once per item with at most N (default: online CPUs) tasks
+ * in flight, starting the next as soon as one exits. "{}" in an argument
+ * is replaced by the item; without it the item is appended. Items come
+ * after ":::" or, if there is none, one per line from stdin (tasks then
+ * get /dev/null as stdin). Each task's exit status is reported on stderr
+ * (-q: failures only). -P places each task before exec: "rr" pins task
+ * k to the k-th allowed CPU, "node:N" runs every task on node N's CPUs
+ * with memory bound there, "spread" deals tasks across the nodes the same
+ * way. Returns the number of failed tasks, at most 101.
+ */
+static int builtin_parallel(Command *cmd) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    TaskReport report = TASK_REPORT_ALL;
+    PlacePolicy policy = PLACE_NONE;
+    int place_node = 0;
+    int i = 1;
+
+    for (; i < cmd->argc && cmd->args[i][0] == '-'; i++) {
+        const char *opt = cmd->args[i];
+        const char *value = NULL;
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(opt, "-q") == 0) {
+            report = TASK_REPORT_FAILURES;
+            continue;
+        } else if (strcmp(opt, "-P") == 0 && i + 1 < cmd->argc) {
+            const char *name = cmd->args[++i];
+            ChildLimits probe = { .nrlimits = 0 };
+            char *end;
+            if (strcmp(name, "rr") == 0) {
+                policy = PLACE_ROUND_ROBIN;
+            } else if (strcmp(name, "spread") == 0) {
+                policy = PLACE_SPREAD;
+            } else if (strncmp(name, "node:", 5) == 0
+                       && (place_node = (int)strtol(name + 5, &end, 10), *end == '\0')
+                       && end != name + 5 && place_on_node(place_node, &probe)) {
+                policy = PLACE_NODE;
+            } else {
+                fprintf(stderr, COLOR_ERROR "parallel: %s: unknown placement "
+                        "(rr, spread or node:N)\n" COLOR_RESET, name);
+                return 2;
+            }
+            continue;
+        } else if (strcmp(opt, "-j") == 0 && i + 1 < cmd->argc) {
+            value = cmd->args[++i];
+        } else if (strncmp(opt, "-j", 2) == 0 && opt[2] != '\0') {
+            value = opt + 2;
+        }
+
+        char *end;
+        if (value == NULL || (max_jobs = strtol(value, &end, 10), *end != '\0')
+            || max_jobs < 1) {
+            fprintf(stderr, COLOR_ERROR "parallel: usage: parallel [-j N] [-q] [-P policy] "
+                    "command [arg...] [::: item...]\n" COLOR_RESET);
+            return 2;
+        }
+    }
+    if (max_jobs < 1) {
+        max_jobs = 1;
+    }
+
+    int tmpl_start = i;
+    int tmpl_end = i;
+    while (tmpl_end < cmd->argc && strcmp(cmd->args[tmpl_end], ":::") != 0) {
+        tmpl_end++;
+    }
+    if (tmpl_end == tmpl_start) {
+        fprintf(stderr, COLOR_ERROR "parallel: no command given\n" COLOR_RESET);
+        return 2;
+    }
+    bool from_stdin = tmpl_end == cmd->argc;
+    int next_arg = tmpl_end + 1;
+
+    InputSource items;
+    FdPlan plan = { .count = 0 };
+    if (from_stdin) {
+        if (!input_open_fd(&items, STDIN_FILENO)) {
+            return 1;
+        }
+        int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (devnull >= 0) {
+            plan.source[0] = devnull;
+            plan.target[0] = STDIN_FILENO;
+            plan.owned[0] = true;
+            plan.count = 1;
+        }
+    }
+
+    ParallelSlot *slots = calloc((size_t)max_jobs, sizeof(ParallelSlot));
+    if (slots == NULL) {
+        perror("calloc");
+        if (from_stdin) {
+            input_close(&items);
+        }
+        release_fd_plan(&plan);
+        return 1;
+    }
+
+    flush_output();
+
+    long running = 0;
+    long seq = 0;
+    int failed = 0;
+    bool exhausted = false;
+
+    while (true) {
+        // Top the pool up to max_jobs.
+        for (long s = 0; s < max_jobs && running < max_jobs && !exhausted; s++) {
+            ParallelSlot *slot = &slots[s];
+            if (slot->pid > 0) {
+                continue;
+            }
+
+            arena_reset(&slot->arena);
+            if (from_stdin) {
+                const char *line;
+                do {
+                    line = input_next_line(&items);
+                } while (line != NULL && line[0] == '\0');
+                if (line == NULL) {
+                    exhausted = true;
+                    break;
+                }
+                slot->item = arena_strndup(&slot->arena, line, strlen(line));
+            } else {
+                if (next_arg >= cmd->argc) {
+                    exhausted = true;
+                    break;
+                }
+                slot->item = cmd->args[next_arg++];
+            }
+
+            slot->seq = ++seq;
+            place_task(policy, place_node, slot->seq, &slot->placement);
+            if (slot->item != NULL
+                && parallel_launch(slot, cmd->args + tmpl_start, tmpl_end - tmpl_start,
+                                   &plan, policy != PLACE_NONE)) {
+                running++;
+            } else {
+                slot->pid = 0;
+                parallel_report(slot, 127, report);
+                failed++;
+            }
+        }
+
+        if (running == 0) {
+            break;
+        }
+        failed += parallel_reap(slots, max_jobs, &running, report);
+    }
+
+    for (long s = 0; s < max_jobs; s++) {
+        arena_reset(&slots[s].arena);
+        free(slots[s].arena.head);
+    }
+    free(slots);
+    release_fd_plan(&plan);
+    if (from_stdin) {
+        input_close(&items);
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+// Items collected for the next xargs batch, as offsets from the input's
+// keep mark so they survive the buffer moving on refill.
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t cap;
+    size_t bytes;           // What the items add to the execve() total
+    char **argv;            // Template plus items, rebuilt per launch
+    size_t argv_cap;
+} XargsBatch;
+
+/*
+ * Start one xargs batch in slot: the template words, then the items
+ * argv points straight into the input buffer; the child has its own copy
+ * once launch_stage() returns, so the buffer can then be reused.
+ * Returns: false if nothing was launched (already reported)
+ */
+static bool xargs_launch(ParallelSlot *slot, const Command *cmd, char **tmpl, int tmpl_argc,
+                         const InputSource *in, XargsBatch *batch, const FdPlan *plan) {
+    size_t need = (size_t)tmpl_argc + batch->count + 1;
+
+    if (need > batch->argv_cap) {
+        char **grown = realloc(batch->argv, need * sizeof(char *));
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        batch->argv = grown;
+        batch->argv_cap = need;
+    }
+
+    memcpy(batch->argv, tmpl, (size_t)tmpl_argc * sizeof(char *));
+    char *base = in->buf + in->keep;
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->argv[tmpl_argc + i] = base + batch->items[i];
+    }
+    batch->argv[need - 1] = NULL;
+
+    Command task = {
+        .args = batch->argv,
+        .argc = (int)(need - 1),
+        .assigns = cmd->assigns,
+        .nassigns = cmd->nassigns,
+    };
+    slot->pid = launch_stage(&task, plan);
+    if (slot->pid <= 0) {
+        slot->pid = 0;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * xargs builtin
+ *   xargs [-0] [-n max] [-P N] [-s bytes] [command [arg...]]
+ * Runs command (default echo) with the items read from stdin, one per
+ * line (-0: NUL-separated), packing as many into each run as execve()
+ * takes: ARG_MAX less the environment, the command words and
+ * XARGS_HEADROOM, or at most -s bytes / -n items. -P keeps N batches
+ * running at once through the parallel runner. Items are terminated in
+ * place in the input buffer and passed without copying. Unlike POSIX
+ * xargs, blanks and quotes are not special and empty input runs nothing.
+ * Returns: 0, 123 if any run failed, 127 if the command could not start
+ */
+static int builtin_xargs(Command *cmd) {
+    long max_items = LONG_MAX;
+    long max_jobs = 1;
+    long max_bytes = LONG_MAX;
+    char sep = '\n';
+    int i = 1;
+
+    for (; i < cmd->argc && cmd->args[i][0] == '-'; i++) {
+        const char *opt = cmd->args[i];
+        const char *value = NULL;
+        long *target = NULL;
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(opt, "-0") == 0) {
+            sep = '\0';
+            continue;
+        }
+
+        switch (opt[1]) {
+        case 'n': target = &max_items; break;
+        case 'P': target = &max_jobs; break;
+        case 's': target = &max_bytes; break;
+        default: break;
+        }
+        if (target != NULL && opt[2] != '\0') {
+            value = opt + 2;
+        } else if (target != NULL && i + 1 < cmd->argc) {
+            value = cmd->args[++i];
+        }
+
+        char *end;
+        if (value == NULL || (*target = strtol(value, &end, 10), *end != '\0')
+            || *target < 1) {
+            fprintf(stderr, COLOR_ERROR "xargs: usage: xargs [-0] [-n max] [-P N] [-s bytes] "
+                    "[command [arg...]]\n" COLOR_RESET);
+            return 2;
+        }
+    }
+
+    char echo_word[] = "echo";
+    char *echo_tmpl[] = { echo_word };
+    char **tmpl = i < cmd->argc ? cmd->args + i : echo_tmpl;
+    int tmpl_argc = i < cmd->argc ? cmd->argc - i : 1;
+
+    // Everything but the items counts against ARG_MAX first.
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = _POSIX_ARG_MAX;
+    }
+    size_t fixed = XARGS_HEADROOM + sizeof(char *);
+    for (char **env = command_envp(cmd); env != NULL && *env != NULL; env++) {
+        fixed += strlen(*env) + 1 + sizeof(char *);
+    }
+    for (int t = 0; t < tmpl_argc; t++) {
+        fixed += strlen(tmpl[t]) + 1 + sizeof(char *);
+    }
+    if (fixed >= (size_t)arg_max) {
+        fprintf(stderr, COLOR_ERROR "xargs: environment and command leave no room "
+                "for items\n" COLOR_RESET);
+        return 1;
+    }
+    size_t budget = (size_t)arg_max - fixed;
+    if ((unsigned long)max_bytes < budget) {
+        budget = (size_t)max_bytes;
+    }
+
+    InputSource in;
+    if (!input_open_fd(&in, STDIN_FILENO)) {
+        return 1;
+    }
+
+    // Tasks must not read the item stream.
+    FdPlan plan = { .count = 0 };
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull >= 0) {
+        plan.source[0] = devnull;
+        plan.target[0] = STDIN_FILENO;
+        plan.owned[0] = true;
+        plan.count = 1;
+    }
+
+    ParallelSlot *slots = calloc((size_t)max_jobs, sizeof(ParallelSlot));
+    if (slots == NULL) {
+        perror("calloc");
+        release_fd_plan(&plan);
+        input_close(&in);
+        return 1;
+    }
+
+    flush_output();
+
+    XargsBatch batch = { .count = 0 };
+    long running = 0;
+    long seq = 0;
+    int failed = 0;
+    bool missing = false;
+
+    in.keep = 0;
+    while (true) {
+        char *item = input_next_record(&in, sep);
+        size_t need = 0;
+
+        if (item != NULL) {
+            if (item[0] == '\0') {
+                continue;
+            }
+            need = strlen(item) + 1 + sizeof(char *);
+            if (need > budget || need - sizeof(char *) > XARGS_ITEM_MAX) {
+                fprintf(stderr, COLOR_ERROR "xargs: %zu-byte item does not fit in a "
+                        "command line\n" COLOR_RESET, need);
+                failed++;
+                continue;
+            }
+        }
+
+        bool full = item == NULL || batch.bytes + need > budget
+                    || batch.count == (size_t)max_items;
+        if (full && batch.count > 0) {
+            while (running == max_jobs) {
+                failed += parallel_reap(slots, max_jobs, &running, TASK_REPORT_NONE);
+            }
+            ParallelSlot *slot = slots;
+            while (slot->pid > 0) {
+                slot++;
+            }
+            slot->seq = ++seq;
+            if (xargs_launch(slot, cmd, tmpl, tmpl_argc, &in, &batch, &plan)) {
+                running++;
+            } else {
+                missing = true;
+                failed++;
+            }
+            batch.count = 0;
+            batch.bytes = 0;
+        }
+        if (item == NULL) {
+            break;
+        }
+
+        // A new batch pins the buffer from its first item on.
+        if (batch.count == 0) {
+            in.keep = (size_t)(item - in.buf);
+        }
+        if (batch.count == batch.cap) {
+            size_t cap = batch.cap ? batch.cap * 2 : 1024;
+            size_t *grown = realloc(batch.items, cap * sizeof(size_t));
+            if (grown == NULL) {
+                perror("realloc");
+                failed++;
+                break;
+            }
+            batch.items = grown;
+            batch.cap = cap;
+        }
+        batch.items[batch.count++] = (size_t)(item - in.buf) - in.keep;
+        batch.bytes += need;
+    }
+
+    while (running > 0) {
+        failed += parallel_reap(slots, max_jobs, &running, TASK_REPORT_NONE);
+    }
+
+    free(batch.items);
+    free(batch.argv);
+    free(slots);
+    release_fd_plan(&plan);
+    input_close(&in);
+    return missing ? 127 : failed > 0 ? 123 : 0;
+}
+
+/*
+ * Convert a timeval to seconds
+ */
+static double timeval_seconds(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/*
+ * Run a pipeline and report where its time went on stderr
+ * user/sys/ctxsw cover the children reaped for this command plus the
+ * shell's own CPU time; the "shell" line splits out parse, PATH lookup
+ * and spawn so shell overhead can be told apart from program cost.
+ */
+static int execute_timed(Pipeline *pipeline) {
+    ShellCounters before = shell_counters;
+    struct rusage self_before, self_after;
+
+    // maxrss is a high-water mark: measure it for this command only.
+    shell_counters.child_maxrss = 0;
+
+    getrusage(RUSAGE_SELF, &self_before);
+    uint64_t started = monotonic_ns();
+
+    int code = execute_command(pipeline);
+
+    uint64_t wall = monotonic_ns() - started;
+    getrusage(RUSAGE_SELF, &self_after);
+
+    struct timeval user, sys, self_user, self_sys;
+    timersub(&shell_counters.child_utime, &before.child_utime, &user);
+    timersub(&shell_counters.child_stime, &before.child_stime, &sys);
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &self_user);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &self_sys);
+    timeradd(&user, &self_user, &user);
+    timeradd(&sys, &self_sys, &sys);
+
+    long maxrss = shell_counters.child_maxrss;
+    if (maxrss < self_after.ru_maxrss && pipeline->nstages == 1
+        && shell_counters.launches == before.launches) {
+        // Nothing was launched: the shell itself ran the command.
+        maxrss = self_after.ru_maxrss;
+    }
+    if (before.child_maxrss > shell_counters.child_maxrss) {
+        shell_counters.child_maxrss = before.child_maxrss;
+    }
+
+    unsigned long launches = shell_counters.launches - before.launches;
+    fprintf(stderr,
+            "real    %.6fs\n"
+            "user    %.6fs\n"
+            "sys     %.6fs\n"
+            "maxrss  %ld KiB\n"
+            "ctxsw   %ld voluntary, %ld involuntary\n"
+            "shell   parse %.1fus, lookup %.1fus, spawn %.1fus (%lu launch%s)\n",
+            (double)wall / 1e9,
+            timeval_seconds(&user),
+            timeval_seconds(&sys),
+            maxrss,
+            shell_counters.child_nvcsw - before.child_nvcsw
+                + (self_after.ru_nvcsw - self_before.ru_nvcsw),
+            shell_counters.child_nivcsw - before.child_nivcsw
+                + (self_after.ru_nivcsw - self_before.ru_nivcsw),
+            (double)last_parse_ns / 1e3,
+            (double)(shell_counters.lookup_ns - before.lookup_ns) / 1e3,
+            (double)(shell_counters.spawn_ns - before.spawn_ns) / 1e3,
+            launches, launches == 1 ? "" : "es");
+    return code;
+}
+
+/*
+ * time builtin
+ *   time command [arg...]  - run command and report time and resources
+ * At the head of a pipeline execute_command() treats time as a keyword
+ * covering every stage; this handler covers it anywhere else.
+ */
+static int builtin_time(Command *cmd) {
+    Command timed = *cmd;
+    Pipeline pipeline = { .first = &timed, .nstages = 1, .background = false };
+
+    timed.args++;
+    timed.argc--;
+    timed.next = NULL;
+    return execute_timed(&pipeline);
+}
+
+/*
+ * Resolve a limit -g name and open the cgroup v2 directory for it
+ * Relative names are taken under CGROUP_ROOT; the directory is created
+ * if missing and cpu.max / memory.max are written before any child runs.
+ * Returns: true with limits->cgroup_fd and procs_fd open
+ */
+static bool open_limit_cgroup(const char *name, const char *cpu_max,
+                              const char *memory_max, ChildLimits *limits) {
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s%s%s", name[0] == '/' ? "" : CGROUP_ROOT,
+                 name[0] == '/' ? "" : "/", name) >= (int)sizeof(path)) {
+        fprintf(stderr, COLOR_ERROR "limit: %s: name too long\n" COLOR_RESET, name);
+        return false;
+    }
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, COLOR_ERROR "limit: %s: %s\n" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+
+    int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+        fprintf(stderr, COLOR_ERROR "limit: %s: %s\n" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+
+    const char *files[] = { "cpu.max", "memory.max" };
+    const char *values[] = { cpu_max, memory_max };
+    for (size_t i = 0; i < 2; i++) {
+        if (values[i] == NULL) {
+            continue;
+        }
+        int fd = openat(dir, files[i], O_WRONLY | O_CLOEXEC);
+        size_t len = strlen(values[i]);
+        if (fd < 0 || write(fd, values[i], len) != (ssize_t)len) {
+            fprintf(stderr, COLOR_ERROR "limit: %s/%s: %s\n" COLOR_RESET,
+                    path, files[i], strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            close(dir);
+            return false;
+        }
+        close(fd);
+    }
+
+    int procs = openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (procs < 0) {
+        fprintf(stderr, COLOR_ERROR "limit: %s/cgroup.procs: %s\n" COLOR_RESET,
+                path, strerror(errno));
+        close(dir);
+        return false;
+    }
+    limits->cgroup_fd = dir;
+    limits->procs_fd = procs;
+    return true;
+}
+
+/*
+ * Parse a taskset-style CPU list such as "0-3,8,10-11"
+ * Returns: false on a syntax error, an out-of-range CPU or an empty list
+ */
+static bool parse_cpu_list(const char *text, cpu_set_t *set) {
+    const char *p = text;
+
+    CPU_ZERO(set);
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        if (!isdigit((unsigned char)*p)) {
+            return false;
+        }
+        long first = strtol(p, &end, 10);
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            if (!isdigit((unsigned char)p[1])) {
+                return false;
+            }
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/*
+ * Format a CPU set back into list form ("0-3,8"), truncated to size
+ */
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        int n = last == cpu
+            ? snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu)
+            : snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        len += n > 0 ? (size_t)n : 0;
+        cpu = last;
+    }
+}
+
+/*
+ * Describe a placement as "cpus 0-3, node 1" for jobs and parallel
+ * cpus may be NULL and node -1 to leave either part out.
+ */
+static void format_placement(const cpu_set_t *cpus, int node, char *buf, size_t size) {
+    char list[256] = "";
+
+    if (cpus != NULL) {
+        format_cpu_list(cpus, list, sizeof(list));
+    }
+    if (cpus != NULL && node >= 0) {
+        snprintf(buf, size, "cpus %s, node %d", list, node);
+    } else if (cpus != NULL) {
+        snprintf(buf, size, "cpus %s", list);
+    } else {
+        snprintf(buf, size, "node %d", node);
+    }
+}
+
+/*
+ * Load the shell's allowed CPUs and the NUMA nodes over them
+ * Nodes are read from NUMA_SYSFS and kept sorted by id; without it the
+ * allowed CPUs form a single node 0.
+ */
+static const CpuTopology *cpu_topology(void) {
+    CpuTopology *topo = &cpu_topo;
+
+    if (topo->loaded) {
+        return topo;
+    }
+    topo->loaded = true;
+
+    if (sched_getaffinity(0, sizeof(topo->allowed), &topo->allowed) != 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        CPU_ZERO(&topo->allowed);
+        for (long cpu = 0; cpu < online && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, &topo->allowed);
+        }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &topo->allowed)) {
+            topo->cpus[topo->ncpus++] = cpu;
+        }
+    }
+
+    DIR *dir = opendir(NUMA_SYSFS);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL && topo->nnodes < MAX_NUMA_NODES) {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) != 0
+            || !isdigit((unsigned char)entry->d_name[4])) {
+            continue;
+        }
+        long id = strtol(entry->d_name + 4, &end, 10);
+        if (*end != '\0' || id >= MAX_NUMA_NODES) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        char text[4096];
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        snprintf(path, sizeof(path), NUMA_SYSFS "/%s/cpulist", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, text, sizeof(text) - 1);
+            close(fd);
+            if (n > 0) {
+                text[n] = '\0';
+                parse_cpu_list(text, &cpus);
+            }
+        }
+
+        // readdir order is arbitrary; insert by id.
+        int k = topo->nnodes++;
+        while (k > 0 && topo->node_id[k - 1] > id) {
+            topo->node_id[k] = topo->node_id[k - 1];
+            topo->node_cpus[k] = topo->node_cpus[k - 1];
+            topo->node_ncpus[k] = topo->node_ncpus[k - 1];
+            k--;
+        }
+        topo->node_id[k] = (int)id;
+        CPU_AND(&topo->node_cpus[k], &cpus, &topo->allowed);
+        topo->node_ncpus[k] = CPU_COUNT(&topo->node_cpus[k]);
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    if (topo->nnodes == 0) {
+        topo->nnodes = 1;
+        topo->node_id[0] = 0;
+        topo->node_cpus[0] = topo->allowed;
+        topo->node_ncpus[0] = topo->ncpus;
+    }
+    return topo;
+}
+
+/*
+ * Place a child on one NUMA node: its allowed CPUs and its memory
+ * Returns: false if there is no such node
+ */
+static bool place_on_node(int node, ChildLimits *limits) {
+    const CpuTopology *topo = cpu_topology();
+
+    for (int i = 0; i < topo->nnodes; i++) {
+        if (topo->node_id[i] != node) {
+            continue;
+        }
+        // A memory-only node gets the memory binding alone.
+        limits->pin_cpus = topo->node_ncpus[i] > 0;
+        if (limits->pin_cpus) {
+            limits->cpus = topo->node_cpus[i];
+        }
+        limits->bind_memory = true;
+        limits->mem_node = node;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Choose the placement of the seq-th (1-based) task under policy
+ * node is only used by PLACE_NODE and must already be valid.
+ */
+static void place_task(PlacePolicy policy, int node, long seq, ChildLimits *limits) {
+    const CpuTopology *topo = cpu_topology();
+
+    *limits = (ChildLimits){ .cgroup_fd = -1, .procs_fd = -1 };
+
+    switch (policy) {
+    case PLACE_NONE:
+        break;
+    case PLACE_ROUND_ROBIN:
+        if (topo->ncpus > 0) {
+            CPU_ZERO(&limits->cpus);
+            CPU_SET(topo->cpus[(seq - 1) % topo->ncpus], &limits->cpus);
+            limits->pin_cpus = true;
+        }
+        break;
+    case PLACE_NODE:
+        place_on_node(node, limits);
+        break;
+    case PLACE_SPREAD: {
+        // Successive tasks go to successive nodes that have CPUs.
+        int with_cpus = 0;
+        for (int i = 0; i < topo->nnodes; i++) {
+            with_cpus += topo->node_ncpus[i] > 0;
+        }
+        long pick = with_cpus > 0 ? (seq - 1) % with_cpus : 0;
+        for (int i = 0; i < topo->nnodes; i++) {
+            if (topo->node_ncpus[i] > 0 && pick-- == 0) {
+                place_on_node(topo->node_id[i], limits);
+                break;
+            }
+        }
+        break;
+    }
+    }
+}
+
+/*
+ * limit builtin
+ *   limit [-v kb] [-n files] [-t secs] command [arg...]
+ *   limit -g cgroup [-C "quota period"] [-M bytes] command [arg...]
+ *   limit [-c cpulist] [-N node] command [arg...]
+ * Runs command with its address space, open files or CPU seconds capped
+ * (unlimited is accepted), and/or inside a cgroup v2 group with cpu.max
+ * and memory.max set first. -c pins it to CPUs like taskset -c; -N puts
+ * it on a NUMA node's CPUs and binds its memory there (-c then narrows
+ * the CPUs). The shell itself is never limited.
+ */
+static int builtin_limit(Command *cmd) {
+    ChildLimits limits = { .nrlimits = 0, .cgroup_fd = -1, .procs_fd = -1 };
+    const char *cgroup = NULL, *cpu_max = NULL, *memory_max = NULL;
+    const char *cpu_list = NULL, *node = NULL;
+    int i = 1;
+
+    for (; i < cmd->argc && cmd->args[i][0] == '-'; i++) {
+        const char *opt = cmd->args[i];
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (opt[1] == '\0' || opt[2] != '\0' || i + 1 >= cmd->argc) {
+            i = cmd->argc;
+            break;
+        }
+
+        const char *value = cmd->args[++i];
+        int resource;
+        switch (opt[1]) {
+        case 'g': cgroup = value; continue;
+        case 'C': cpu_max = value; continue;
+        case 'M': memory_max = value; continue;
+        case 'c': cpu_list = value; continue;
+        case 'N': node = value; continue;
+        case 'v': resource = RLIMIT_AS; break;
+        case 'n': resource = RLIMIT_NOFILE; break;
+        case 't': resource = RLIMIT_CPU; break;
+        default:
+            i = cmd->argc;
+            continue;
+        }
+
+        rlim_t amount = RLIM_INFINITY;
+        if (strcmp(value, "unlimited") != 0) {
+            char *end;
+            errno = 0;
+            unsigned long long n = strtoull(value, &end, 10);
+            if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+                fprintf(stderr, COLOR_ERROR "limit: %s: invalid number\n" COLOR_RESET, value);
+                return 2;
+            }
+            amount = resource == RLIMIT_AS ? (rlim_t)n * 1024 : (rlim_t)n;
+        }
+
+        // A repeated option replaces the earlier value.
+        int slot = 0;
+        while (slot < limits.nrlimits && limits.resource[slot] != resource) {
+            slot++;
+        }
+        limits.resource[slot] = resource;
+        limits.value[slot] = amount;
+        if (slot == limits.nrlimits) {
+            limits.nrlimits++;
+        }
+    }
+
+    if (i >= cmd->argc) {
+        fprintf(stderr, COLOR_ERROR "limit: usage: limit [-v kb] [-n files] [-t secs] "
+                "[-g cgroup [-C cpu.max] [-M memory.max]] [-c cpulist] [-N node] "
+                "command [arg...]\n" COLOR_RESET);
+        return 2;
+    }
+    if (node != NULL) {
+        char *end;
+        long id = strtol(node, &end, 10);
+        if (end == node || *end != '\0' || id < 0 || id > INT_MAX
+            || !place_on_node((int)id, &limits)) {
+            fprintf(stderr, COLOR_ERROR "limit: %s: no such NUMA node\n" COLOR_RESET, node);
+            return 2;
+        }
+    }
+    if (cpu_list != NULL) {
+        cpu_set_t cpus;
+        if (!parse_cpu_list(cpu_list, &cpus)) {
+            fprintf(stderr, COLOR_ERROR "limit: %s: invalid CPU list\n" COLOR_RESET, cpu_list);
+            return 2;
+        }
+        // With -N the list narrows the node's CPUs rather than leaving it.
+        if (limits.pin_cpus) {
+            CPU_AND(&cpus, &cpus, &limits.cpus);
+            if (CPU_COUNT(&cpus) == 0) {
+                fprintf(stderr, COLOR_ERROR "limit: %s: no CPUs on node %s\n" COLOR_RESET,
+                        cpu_list, node);
+                return 2;
+            }
+        }
+        limits.cpus = cpus;
+        limits.pin_cpus = true;
+    }
+    if ((cpu_max != NULL || memory_max != NULL) && cgroup == NULL) {
+        fprintf(stderr, COLOR_ERROR "limit: -C and -M need -g cgroup\n" COLOR_RESET);
+        return 2;
+    }
+    if (cgroup != NULL && !open_limit_cgroup(cgroup, cpu_max, memory_max, &limits)) {
+        return 1;
+    }
+
+    // As a pipeline stage (or & job) this process is the job's pid, so it
+    // takes the placement too and jobs reports what the command runs on.
+    if (in_stage_child && !apply_placement(&limits)) {
+        fprintf(stderr, COLOR_ERROR "limit: placement: %s\n" COLOR_RESET, strerror(errno));
+        return 1;
+    }
+
+    // Redirections were already applied to the descriptors this runs on.
+    Command limited = *cmd;
+    Pipeline pipeline = { .first = &limited, .nstages = 1, .background = false };
+
+    limited.args += i;
+    limited.argc -= i;
+    limited.redirs = NULL;
+    limited.nredirs = 0;
+    limited.limits = &limits;
+    limited.next = NULL;
+
+    int status = execute_command(&pipeline);
+    if (limits.cgroup_fd >= 0) {
+        close(limits.procs_fd);
+        close(limits.cgroup_fd);
+    }
+    return status;
+}
+
+/*
+ * Run a pipeline and queue a trace record for it
+ * Only counter copies and two clock reads happen on this path; the
+ * writer thread does the formatting and I/O.
+ */
+static int execute_traced(Pipeline *pipeline) {
+    TraceRing *ring = &trace_ring;
+    ShellCounters before = shell_counters;
+
+    // As in execute_timed(), maxrss is measured for this command alone.
+    shell_counters.child_maxrss = 0;
+    shell_counters.last_pid = 0;
+    uint64_t started = monotonic_ns();
+
+    int code = option_timing ? execute_timed(pipeline) : execute_command(pipeline);
+
+    uint64_t ended = monotonic_ns();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (!ring->enabled) {
+        // The command itself ran set +o trace.
+    } else if (head - tail >= TRACE_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    } else {
+        TraceRecord *rec = &ring->slots[head & (TRACE_RING_SLOTS - 1)];
+        rec->start_ns = started;
+        rec->end_ns = ended;
+        rec->parse_ns = last_parse_ns;
+        rec->lookup_ns = shell_counters.lookup_ns - before.lookup_ns;
+        rec->spawn_ns = shell_counters.spawn_ns - before.spawn_ns;
+        rec->wait_ns = shell_counters.wait_ns - before.wait_ns;
+        timersub(&shell_counters.child_utime, &before.child_utime, &rec->utime);
+        timersub(&shell_counters.child_stime, &before.child_stime, &rec->stime);
+        rec->maxrss = shell_counters.child_maxrss;
+        rec->nvcsw = shell_counters.child_nvcsw - before.child_nvcsw;
+        rec->nivcsw = shell_counters.child_nivcsw - before.child_nivcsw;
+        rec->pid = shell_counters.last_pid;
+        rec->status = code;
+        rec->nstages = pipeline->nstages;
+        rec->background = pipeline->background;
+
+        // "a b | c", cut to fit; the writer escapes it.
+        size_t len = 0;
+        for (Command *cmd = pipeline->first; cmd != NULL; cmd = cmd->next) {
+            for (int i = 0; i < cmd->argc && len + 1 < TRACE_COMMAND_MAX; i++) {
+                size_t n = strlen(cmd->args[i]);
+                if (n > TRACE_COMMAND_MAX - 1 - len) {
+                    n = TRACE_COMMAND_MAX - 1 - len;
+                }
+                memcpy(rec->command + len, cmd->args[i], n);
+                len += n;
+                if (len + 1 < TRACE_COMMAND_MAX && (i + 1 < cmd->argc || cmd->next)) {
+                    rec->command[len++] = ' ';
+                }
+            }
+            if (cmd->next != NULL && len + 2 < TRACE_COMMAND_MAX) {
+                memcpy(rec->command + len, "| ", 2);
+                len += 2;
+            }
+        }
+        rec->command[len] = '\0';
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
 
-// Global flag for signal handling.
-static volatile sig_atomic_t child_exited = 0;
+    if (before.child_maxrss > shell_counters.child_maxrss) {
+        shell_counters.child_maxrss = before.child_maxrss;
+    }
+    return code;
+}
 
 /*
- * Display shell prompt with current directory
+ * Write text into out as the body of a JSON string
+ * A multibyte character cut off at the end of the record is dropped.
+ * Returns: bytes written (out is NUL-terminated, size >= 1)
  */
-static void display_prompt(void) {
-    char cwd[MAX_TOKEN_SIZE];
+static size_t json_escape(char *out, size_t size, const char *text) {
+    size_t end = strlen(text);
+    size_t o = 0;
 
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        prntf(COLOR_PROMPT "%s $ " COLOR_RESET, cwd);
-    } else {
-        printf(COLOR_PROMPT "shell $ " COLOR_RESET);
+    // Back off a UTF-8 sequence that lost its tail to truncation.
+    size_t lead = end;
+    while (lead > 0 && ((unsigned char)text[lead - 1] & 0xC0) == 0x80) {
+        lead--;
     }
-    fflush(stdout);
+    if (lead > 0 && (unsigned char)text[lead - 1] >= 0xC0) {
+        unsigned char c = (unsigned char)text[lead - 1];
+        size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+        if (end - (lead - 1) < need) {
+            end = lead - 1;
+        }
+    }
+
+    for (size_t i = 0; i < end && o + 7 < size; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            out[o++] = '\\';
+            out[o++] = (char)c;
+        } else if (c < 0x20) {
+            o += (size_t)snprintf(out + o, size - o, "\\u%04x", c);
+        } else {
+            out[o++] = (char)c;
+        }
+    }
+    out[o] = '\0';
+    return o;
 }
 
 /*
- * Read a line of input from stdin
- * Returns: Dynamically allocated string (caller must free)
+ * Append one record to buf in the ring's format
+ * Returns: bytes appended, at most TRACE_RECORD_MAX
  */
-static char *read_line(void) {
-    char *line = NULL;
-    size_t bufsize = 0;
+static size_t trace_format(const TraceRing *ring, const TraceRecord *rec, char *buf) {
+    char command[TRACE_RECORD_MAX / 2];
+    int n;
 
-    ssize_t len = getline(&line, &bufsize, stdin);
-
-    if(len == -1) {
-        free(line);
-        return NULL;
+    json_escape(command, sizeof(command), rec->command);
+    if (ring->chrome) {
+        // A complete ("X") event per command; ts and dur in microseconds.
+        n = snprintf(buf, TRACE_RECORD_MAX,
+                     "{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"X\","
+                     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{"
+                     "\"status\":%d,\"child_pid\":%d,\"stages\":%d,\"background\":%s,"
+                     "\"parse_us\":%.3f,\"lookup_us\":%.3f,\"spawn_us\":%.3f,"
+                     "\"wait_us\":%.3f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+                     "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}},\n",
+                     command, (double)rec->start_ns / 1e3,
+                     (double)(rec->end_ns - rec->start_ns) / 1e3,
+                     (int)ring->owner, (int)ring->owner,
+                     rec->status, (int)rec->pid, rec->nstages,
+                     rec->background ? "true" : "false",
+                     (double)rec->parse_ns / 1e3, (double)rec->lookup_ns / 1e3,
+                     (double)rec->spawn_ns / 1e3, (double)rec->wait_ns / 1e3,
+                     timeval_seconds(&rec->utime), timeval_seconds(&rec->stime),
+                     rec->maxrss, rec->nvcsw, rec->nivcsw);
+    } else {
+        n = snprintf(buf, TRACE_RECORD_MAX,
+                     "{\"command\":\"%s\",\"shell_pid\":%d,\"start_us\":%.3f,"
+                     "\"dur_us\":%.3f,\"status\":%d,\"child_pid\":%d,\"stages\":%d,"
+                     "\"background\":%s,\"parse_us\":%.3f,\"lookup_us\":%.3f,"
+                     "\"spawn_us\":%.3f,\"wait_us\":%.3f,\"user_s\":%.6f,"
+                     "\"sys_s\":%.6f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                     command, (int)ring->owner, (double)rec->start_ns / 1e3,
+                     (double)(rec->end_ns - rec->start_ns) / 1e3,
+                     rec->status, (int)rec->pid, rec->nstages,
+                     rec->background ? "true" : "false",
+                     (double)rec->parse_ns / 1e3, (double)rec->lookup_ns / 1e3,
+                     (double)rec->spawn_ns / 1e3, (double)rec->wait_ns / 1e3,
+                     timeval_seconds(&rec->utime), timeval_seconds(&rec->stime),
+                     rec->maxrss, rec->nvcsw, rec->nivcsw);
     }
+    return n < 0 ? 0 : (size_t)n < TRACE_RECORD_MAX ? (size_t)n : TRACE_RECORD_MAX - 1;
+}
 
-    // remove the trailing new line.
-    if (len > 0 && lin[len - 1] == '\n') {
-        line[len - 1] = '\0';
+/*
+ * Write all of buf to the trace file
+ */
+static void trace_flush(const TraceRing *ring, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(ring->fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
     }
-
-    return line;
 }
 
 /*
- * Parse input line into Command structure
- * Handles tokenization and argument splitting
+ * Trace writer thread: drain the ring into the file in large writes
+ * On stop it empties the ring before returning, so trace_stop() loses
+ * nothing that was recorded.
  */
-static Command *parse_line(char *line) {
-    Command *cmd = calloc(1, sizeof(Command));
-    if (cmd == NULL) {
-        perror("calloc");
+static void *trace_writer(void *arg) {
+    TraceRing *ring = arg;
+    char *buf = malloc(TRACE_WRITE_BUFFER);
+    unsigned long reported = 0;
+
+    if (buf == NULL) {
         return NULL;
     }
 
-    cmd->background = false;
-    cmd->argc = 0;
+    size_t len = 0;
+    if (ring->chrome) {
+        len = (size_t)snprintf(buf, TRACE_WRITE_BUFFER,
+                               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                               "\"args\":{\"name\":\"myshell %d\"}},\n",
+                               (int)ring->owner, (int)ring->owner);
+    }
 
-    char *token;
-    char *saveptr;
+    while (true) {
+        bool stopping = atomic_load(&ring->stop);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        bool idle = tail == head;
 
-    // Tokenize by whitespace.
-    token = strtok_r(line, "\t\r\n", &saveptr);
+        for (; tail != head; tail++) {
+            if (len + TRACE_RECORD_MAX > TRACE_WRITE_BUFFER) {
+                trace_flush(ring, buf, len);
+                len = 0;
+            }
+            len += trace_format(ring, &ring->slots[tail & (TRACE_RING_SLOTS - 1)], buf + len);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
 
-    while (token != NULL && cmd->argc < MAX_ARGS - 1) {
-        if(strcmp(token, "&") == 0) {
-            cmd->background = true;
-            break;
+        unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != reported && len + TRACE_RECORD_MAX <= TRACE_WRITE_BUFFER) {
+            if (ring->chrome) {
+                len += (size_t)snprintf(buf + len, TRACE_RECORD_MAX,
+                                        "{\"name\":\"trace records dropped\",\"ph\":\"i\","
+                                        "\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                        "\"args\":{\"count\":%lu}},\n",
+                                        (double)monotonic_ns() / 1e3, (int)ring->owner,
+                                        (int)ring->owner, dropped - reported);
+            } else {
+                len += (size_t)snprintf(buf + len, TRACE_RECORD_MAX,
+                                        "{\"shell_pid\":%d,\"dropped\":%lu}\n",
+                                        (int)ring->owner, dropped - reported);
+            }
+            reported = dropped;
         }
 
-        // Allcate and copy token.
-        cmd->args[cmd->argc] = strdup(token);
-        if (cmd->args[cmd->argc] == NULL) {
-            perror("strdup");
-            free_command(cmd);
-            return NULL;
+        if (len > 0) {
+            trace_flush(ring, buf, len);
+            len = 0;
+        }
+        if (stopping) {
+            break;
+        }
+        if (idle) {
+            struct timespec pause = { .tv_sec = 0, .tv_nsec = TRACE_IDLE_MS * 1000000L };
+            nanosleep(&pause, NULL);
         }
-        cmd->argc++;
-        token = strtok_r(NULL, " \t\r\n", &saveptr);
     }
-    // NULL-terminate argv array (required by execvp)
-    cmd->args[cmd->argc] = NULL;
 
-    return cmd;
+    free(buf);
+    return NULL;
 }
 
 /*
- * Free all allocated memory in Command structure
+ * Start recording commands to path, replacing any current trace
+ * Paths ending in .jsonl get one JSON object per line; anything else
+ * gets Chrome trace events, loadable in Perfetto. Several shells may
+ * append to one file: the one that creates it writes the opening '[',
+ * and the closing ']' is optional in that format.
+ * Returns: false if the file or writer thread could not be set up
  */
-static void free_command(Command *cmd) {
-    if (cmd == NULL) {
-        return;
+static bool trace_start(const char *path) {
+    TraceRing *ring = &trace_ring;
+    static bool registered;
+    size_t len = strlen(path);
+
+    trace_stop();
+    ring->chrome = len < 6 || strcmp(path + len - 6, ".jsonl") != 0;
+
+    bool created = true;
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        struct stat st;
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        created = fd >= 0 && fstat(fd, &st) == 0 && st.st_size == 0;
+    }
+    if (fd < 0) {
+        fprintf(stderr, COLOR_ERROR "trace: %s: %s\n" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+    if (ring->slots == NULL) {
+        ring->slots = calloc(TRACE_RING_SLOTS, sizeof(TraceRecord));
+        if (ring->slots == NULL) {
+            perror("calloc");
+            close(fd);
+            return false;
+        }
+    }
+    ring->fd = fd;
+    if (created && ring->chrome) {
+        trace_flush(ring, "[\n", 2);
     }
 
-    for (int 1 =0; i < cmd->argc; i++) {
-        free(cmd->ars[i]);
+    ring->owner = getpid();
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->stop, false);
+    atomic_store(&ring->dropped, 0);
+    int err = pthread_create(&ring->writer, NULL, trace_writer, ring);
+    if (err != 0) {
+        fprintf(stderr, COLOR_ERROR "trace: %s\n" COLOR_RESET, strerror(err));
+        close(fd);
+        ring->fd = -1;
+        return false;
     }
+    ring->enabled = true;
 
-    free(cmd);
+    // exit() from anywhere still drains the ring.
+    if (!registered) {
+        atexit(trace_stop);
+        registered = true;
+    }
+    return true;
 }
 
 /*
- * Setup signal handlers for shell
+ * Stop recording: drain the ring, end the writer and close the file
+ * A forked child has no writer thread of its own and just lets go.
  */
-static void setup_signal_handlers(void) {
-    struct sigaction sa;
-    
-    // Handle SIGCHLD to reap background processes
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+static void trace_stop(void) {
+    TraceRing *ring = &trace_ring;
+
+    if (!ring->enabled) {
+        return;
     }
-    
-    // Ignore SIGINT (Ctrl+C) in shell itself
-    // Child processes will still receive it
-    signal(SIGINT, SIG_IGN);
+    ring->enabled = false;
+    if (ring->owner == getpid()) {
+        atomic_store(&ring->stop, true);
+        pthread_join(ring->writer, NULL);
+    }
+    close(ring->fd);
+    ring->fd = -1;
 }
 
 /*
- * Signal handler for SIGCHLD
- * Reaps zombie background processes
+ * Give a forked shell (a --server client) its own writer thread
+ * The file stays shared; records already queued belong to the parent.
  */
+static void trace_after_fork(void) {
+    TraceRing *ring = &trace_ring;
 
- static void sigchld_handler(int signo) {
-    (void)signo;
+    if (!ring->enabled) {
+        return;
+    }
+    ring->owner = getpid();
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->stop, false);
+    atomic_store(&ring->dropped, 0);
+    if (pthread_create(&ring->writer, NULL, trace_writer, ring) != 0) {
+        close(ring->fd);
+        ring->fd = -1;
+        ring->enabled = false;
+    }
+}
 
-    int saved_errno = errno;
-    pid_t pid;
-    int status;
+/*
+ * set builtin
+ *   set -o         - list options and their state
+ *   set -o name    - enable an option
+ *   set +o name    - disable an option
+ *   set -o trace=FILE - record every command to FILE (.jsonl: JSON lines)
+ */
+static int builtin_set(Command *cmd) {
+    size_t count = sizeof(shell_options) / sizeof(shell_options[0]);
 
-    // reapping all terminated children.
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        printf("\n[Backgorund] Process %d terminated\n", pid);
-        child_exited = 1;
+    if (cmd->argc == 1 || (cmd->argc == 2 && strcmp(cmd->args[1], "-o") == 0)) {
+        for (size_t i = 0; i < count; i++) {
+            out_printf("%-12s %-3s  %s\n", shell_options[i].name,
+                       *shell_options[i].flag ? "on" : "off", shell_options[i].summary);
+        }
+        return 0;
     }
-    errno = saved_errno;
- }
+
+    int status = 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *flag = cmd->args[i];
+        if ((strcmp(flag, "-o") != 0 && strcmp(flag, "+o") != 0) || i + 1 >= cmd->argc) {
+            fprintf(stderr, COLOR_ERROR "set: usage: set [-o|+o] option\n" COLOR_RESET);
+            return 2;
+        }
+
+        const char *name = cmd->args[++i];
+        const char *value = strchr(name, '=');
+        size_t name_len = value != NULL ? (size_t)(value - name) : strlen(name);
+        size_t j = 0;
+        while (j < count && (strncmp(shell_options[j].name, name, name_len) != 0
+                             || shell_options[j].name[name_len] != '\0')) {
+            j++;
+        }
+        if (j == count) {
+            fprintf(stderr, COLOR_ERROR "set: %s: invalid option name\n" COLOR_RESET, name);
+            status = 1;
+            continue;
+        }
+
+        // trace is switched on with its file: set -o trace=FILE.
+        if (shell_options[j].flag == &trace_ring.enabled) {
+            if (flag[0] == '+') {
+                trace_stop();
+            } else if (value == NULL || value[1] == '\0') {
+                fprintf(stderr, COLOR_ERROR "set: trace needs a file: set -o trace=FILE\n"
+                        COLOR_RESET);
+                status = 1;
+            } else if (!trace_start(value + 1)) {
+                status = 1;
+            }
+            continue;
+        }
+        if (value != NULL) {
+            fprintf(stderr, COLOR_ERROR "set: %.*s: option takes no value\n" COLOR_RESET,
+                    (int)name_len, name);
+            status = 1;
+            continue;
+        }
+        *shell_options[j].flag = flag[0] == '-';
+    }
+    return status;
+}
 
 /*
- * Execute external command using fork/exec pattern
- * Demonstrates core process management concepts
+ * Copy everything from in_fd to out_fd inside the kernel where possible
+ * Tries copy_file_range (file to file), then sendfile (file to anything),
+ * then splice (either end a pipe), and only then a read/write loop.
+ * Returns: 0 on success, -1 with errno set
  */
-static int execute_external(Command *cmd) {
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        // Fork failed
-        perror("fork");
-        return 1;
+static int copy_fd(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    ssize_t n;
+
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return -1;
     }
-    
-    if (pid == 0) {
-        // Child process: execute the command
-        execvp(cmd->args[0], cmd->args);
-        
-        // execvp only returns on error
-        fprintf(stderr, COLOR_ERROR "%s: command not found\n" COLOR_RESET, 
-                cmd->args[0]);
-        exit(EXIT_FAILURE);
+
+    // copy_file_range refuses O_APPEND destinations.
+    int out_flags = fcntl(out_fd, F_GETFL);
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)
+        && out_flags != -1 && !(out_flags & O_APPEND)) {
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+            && errno != EOPNOTSUPP) {
+            return -1;
+        }
     }
-    
-    // Parent process
-    if (!cmd->background) {
-        // Foreground: wait for child to complete
-        int status;
-        pid_t wait_result;
-        
+
+    if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+    }
+
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
         do {
-            wait_result = waitpid(pid, &status, 0);
-        } while (wait_result == -1 && errno == EINTR);
-        
-        if (wait_result == -1) {
-            perror("waitpid");
-            return 1;
+            n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+        } while (n > 0 || (n == -1 && errno == EINTR));
+        if (n == 0) {
+            return 0;
         }
-        
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
         }
-    } else {
-        // Background: don't wait
-        printf("[Background] Process %d started\n", pid);
     }
-    
-    return 0;
-}
 
+    // Terminals and other special files: plain copy loop.
+    char buf[INPUT_BLOCK_SIZE];
+    while (true) {
+        n = read(in_fd, buf, sizeof(buf));
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(out_fd, buf + done, (size_t)(n - done));
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += w;
+        }
+    }
+}
 
 /*
- * Execute a command - dispatches to builtin or external
+ * Run an external command from inside a builtin and wait for it
  */
-static int execute_command(Command *cmd) {
-    if (cmd->argc == 0) {
-        return 0;
-    }
-    
-    // Check if it's a builtin command
-    int result = execute_builtin(cmd);
-    
-    if (result == -1) {
-        // Not a builtin, execute as external command
-        return execute_external(cmd);
+static int run_external_now(Command *cmd) {
+    FdPlan plan = { .count = 0 };
+
+    flush_output();
+    pid_t pid = execute_external(cmd, &plan);
+    if (pid < 0) {
+        return 127;
     }
-    
-    return result;
+    return wait_pipeline(&pid, 1, 0);
 }
 
 /*
- * Execute builtin commands (must run in shell process)
+ * cat builtin
+ *   cat [file|-]...  - copy operands (default stdin) to stdout via copy_fd()
+ * Any option is handed to the external cat.
  */
-static int execute_builtin(Command *cmd) {
-    const char *command = cmd->args[0];
-    
-    // cd - change directory
-    if (strcmp(command, "cd") == 0) {
-        const char *path = (cmd->argc > 1) ? cmd->args[1] : getenv("HOME");
-        
-        if (path == NULL) {
-            fprintf(stderr, COLOR_ERROR "cd: HOME not set\n" COLOR_RESET);
-            return 1;
+static int builtin_cat(Command *cmd) {
+    for (int i = 1; i < cmd->argc; i++) {
+        if (cmd->args[i][0] == '-' && cmd->args[i][1] != '\0') {
+            return run_external_now(cmd);
         }
-        
-        if (chdir(path) != 0) {
-            perror("cd");
-            return 1;
+    }
+
+    flush_output();
+
+    // Copying a regular file onto itself (cat a >> a) never reaches EOF.
+    struct stat out_st;
+    bool out_regular = fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode);
+
+    int status = 0;
+    int i = 1;
+    do {
+        const char *name = i < cmd->argc ? cmd->args[i] : "-";
+        int fd = STDIN_FILENO;
+
+        if (strcmp(name, "-") != 0) {
+            fd = open(name, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                fprintf(stderr, COLOR_ERROR "cat: %s: %s\n" COLOR_RESET,
+                        name, strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+
+        struct stat in_st;
+        if (out_regular && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev
+            && in_st.st_ino == out_st.st_ino) {
+            fprintf(stderr, COLOR_ERROR "cat: %s: input file is output file\n" COLOR_RESET,
+                    name);
+            status = 1;
+        } else if (copy_fd(fd, STDOUT_FILENO) == -1) {
+            fprintf(stderr, COLOR_ERROR "cat: %s: %s\n" COLOR_RESET,
+                    name, strerror(errno));
+            status = 1;
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
         }
+    } while (++i < cmd->argc);
+
+    return status;
+}
+
+/*
+ * hash builtin
+ *   hash          - list cached commands with hit counts and cache statistics
+ *   hash -r       - forget every cached path
+ *   hash name...  - resolve and remember the given commands
+ */
+static int builtin_hash(Command *cmd) {
+    if (cmd->argc > 1 && strcmp(cmd->args[1], "-r") == 0) {
+        path_cache_clear();
         return 0;
     }
-    
-    // exit - terminate shell
-    if (strcmp(command, "exit") == 0) {
-        int exit_code = (cmd->argc > 1) ? atoi(cmd->args[1]) : 0;
-        exit(exit_code);
-    }
-    
-    // help - display help information
-    if (strcmp(command, "help") == 0) {
-        printf("\nModern C Shell - Available Commands:\n");
-        printf("  cd [dir]     - Change directory\n");
-        printf("  exit [code]  - Exit shell\n");
-        printf("  help         - Display this help\n");
-        printf("  pwd          - Print working directory\n");
-        printf("  <command> &  - Run command in background\n");
-        printf("\nAny other command will be executed as an external program.\n\n");
-        return 0;
+
+    if (cmd->argc > 1) {
+        int status = 0;
+        for (int i = 1; i < cmd->argc; i++) {
+            if (lookup_command(cmd->args[i]) == NULL) {
+                fprintf(stderr, COLOR_ERROR "hash: %s: not found\n" COLOR_RESET,
+                        cmd->args[i]);
+                status = 1;
+            }
+        }
+        return status;
     }
-    
-    // pwd - print working directory
-    if (strcmp(command, "pwd") == 0) {
-        char cwd[MAX_TOKEN_SIZE];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s\n", cwd);
-            return 0;
-        } else {
-            perror("pwd");
-            return 1;
+
+    if (path_cache.count > 0) {
+        out_printf("hits\tcommand\n");
+        for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (PathEntry *entry = path_cache.buckets[i]; entry; entry = entry->next) {
+                out_printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
         }
     }
-    
-    return -1;  // Not a builtin
+    out_printf("hash: %zu cached, %lu hits, %lu misses\n",
+               path_cache.count, path_cache.hits, path_cache.misses);
+    return 0;
 }
 
-
 /*
-* Main REPL loop
-* Continuosly reads, parses, and executes commands.
-*/
-int main(void) {
-    setup_signal_handlers();
-
-    printf(COLOR_SUCCESS "Modern C shell v1.0\n", COLOR_RESET);
-    printf("Type 'help' for available commands, 'exit' to quit\n\n");
+ * Print command-line usage
+ */
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [--startup-trace] [-c command | --server socket | script]\n",
+            progname);
+}
 
+/*
+ * Read, parse and execute lines until the input ends
+ * In server_client mode each line is answered with a frame
+ * "\036status=N real_us=T\n" once its output has been written.
+ * Returns: status of the last line
+ */
+static int run_commands(InputSource *input, bool interactive) {
+    int status = 0;
     while(true) {
-        display_prompt();
+        arena_reset(&line_arena);
+        for (int i = 1; i < GLOB_MAX_THREADS; i++) {
+            arena_reset(&glob_arenas[i]);
+        }
+        reap_jobs();
+
+        // The editor draws its own prompt.
+        bool edit = prompt_enabled && editor_available();
+        if (interactive) {
+            notify_jobs();
+            if (prompt_enabled && !edit) {
+                display_prompt();
+            }
+            out_flush();
+        }
 
-        char *line = read_line();
+        char *line = edit ? editor_read_line(input) : input_next_line(input);
         if (line == NULL) {
             break;
         }
 
         // skipping empty lines.
-        if (strlen(line) == 0) {
-            free(line);
+        if (line[0] == '\0' && !server_client) {
             continue;
         }
+        // Recorded before the lexer cooks the line in place.
+        if (interactive) {
+            history_add(line);
+        }
 
-        Command *cmd = parse_line(line);
-        free(line);
+        uint64_t parse_start = monotonic_ns();
+        Pipeline *pipeline = parse_cached(line, &line_arena);
+        last_parse_ns = monotonic_ns() - parse_start;
 
-        if (cmd == NULL) {
-            continue;
+        if (pipeline == NULL) {
+            status = 2;
+            last_status = status;
+        } else {
+            status = execute_list(pipeline);
+        }
+
+        if (server_client) {
+            out_printf("%cstatus=%d real_us=%llu\n", SERVER_STATUS_MARK, status,
+                       (unsigned long long)((monotonic_ns() - parse_start) / 1000));
+            out_flush();
+        }
+    }
+    return status;
+}
+
+/*
+ * SIGCHLD wakeup in the server: collect finished connection shells
+ */
+static void server_reap(int fd, short revents, void *data) {
+    char drain[64];
+    (void)revents;
+    (void)data;
+
+    while (read(fd, drain, sizeof(drain)) > 0) {
+    }
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+}
+
+/*
+ * New client on the server socket: fork a shell for the connection
+ * The child starts from the server's warm state (variables, cwd, PATH
+ * and parse caches, registered builtins) and keeps its own from then
+ * on, so cd and export in one client never leak into another.
+ */
+static void server_accept(int fd, short revents, void *data) {
+    (void)revents;
+    (void)data;
+
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+            perror("accept");
         }
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(client);
+        return;
+    }
+    if (pid > 0) {
+        close(client);
+        return;
+    }
+
+    // Child: the connection becomes stdin/stdout/stderr.
+    close(fd);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    if (dup2(client, STDIN_FILENO) < 0 || dup2(client, STDOUT_FILENO) < 0
+        || dup2(client, STDERR_FILENO) < 0) {
+        _exit(1);
+    }
+    close(client);
+    inherited_fd_end = STDERR_FILENO + 1;
+
+    // Own SIGCHLD pipe and event table; the server's are not ours.
+    // SIGPIPE goes back to default so commands see it (yes | head);
+    // if the client hangs up, this shell ends with its connection.
+    event_loop.count = 0;
+    signal(SIGPIPE, SIG_DFL);
+    setup_signal_handlers(false);
+    if (sigchld_pipe[0] >= 0) {
+        event_add(sigchld_pipe[0], POLLIN, sigchld_event, NULL);
+    }
+    server_client = true;
+    trace_after_fork();
+
+    InputSource input;
+    if (!input_open_fd(&input, STDIN_FILENO)) {
+        _exit(1);
+    }
+    int status = run_commands(&input, false);
+    flush_output();
+    exit(status);
+}
+
+/*
+ * --server: accept newline-framed command batches on a Unix socket
+ * Each connection gets its own shell process, forked from this one, that
+ * runs lines as they arrive and answers each with a status frame.
+ * Returns: only on setup failure, with an exit status
+ */
+static int run_server(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, COLOR_ERROR "--server: %s: path too long\n" COLOR_RESET, path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    // A socket left behind by an earlier server is replaced.
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, SERVER_BACKLOG) < 0) {
+        fprintf(stderr, COLOR_ERROR "--server: %s: %s\n" COLOR_RESET, path, strerror(errno));
+        close(fd);
+        return 1;
+    }
 
-        if (cmd -> argc > 0) {
-            execute_command(cmd);
+    // Clients write to their own sockets; a vanished one must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    if (sigchld_pipe[0] >= 0) {
+        event_add(sigchld_pipe[0], POLLIN, server_reap, NULL);
+    }
+    if (!event_add(fd, POLLIN, server_accept, NULL)) {
+        close(fd);
+        return 1;
+    }
+
+    // There is no input of our own: service accepts and reaps forever.
+    while (true) {
+        event_wait_readable(-1);
+    }
+}
+
+/*
+* Main REPL loop
+* Continuosly reads, parses, and executes commands.
+* Runs a script or -c string non-interactively, or stdin when it is piped.
+*/
+int main(int argc, char **argv) {
+    InputSource input;
+    bool opened;
+    const char *server_path = NULL;
+
+    if (argc > 1 && strcmp(argv[1], "--startup-trace") == 0) {
+        struct timespec cpu;
+        startup_trace = true;
+        startup_begin_ns = startup_last_ns = monotonic_ns();
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        fprintf(stderr, "startup: %-20s %9.1f us  (cpu before main)\n", "exec, loader",
+                (double)cpu.tv_sec * 1e6 + (double)cpu.tv_nsec / 1000.0);
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    // Record what we inherited before opening anything of our own.
+    int inherited = highest_open_fd();
+    if (inherited >= 0) {
+        inherited_fd_end = inherited < STDERR_FILENO ? STDERR_FILENO + 1 : inherited + 1;
+    }
+    startup_phase("inherited fds");
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            usage(argv[0]);
+            return 2;
         }
-        free(cmd);
+        opened = input_open_string(&input, argv[2]);
+    } else if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: --server: option requires an argument\n", argv[0]);
+            usage(argv[0]);
+            return 2;
+        }
+        server_path = argv[2];
+        opened = true;
+    } else if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        fprintf(stderr, "%s: %s: invalid option\n", argv[0], argv[1]);
+        usage(argv[0]);
+        return 2;
+    } else if (argc > 1) {
+        opened = input_open_file(&input, argv[1]);
+    } else {
+        opened = input_open_fd(&input, STDIN_FILENO);
+    }
+    if (!opened) {
+        return 127;
+    }
+    startup_phase("options, input");
+
+    // Only a terminal on stdin with no script or -c is interactive, and
+    // the prompt is only drawn when it would land on a terminal too.
+    bool interactive = argc == 1 && isatty(STDIN_FILENO);
+    prompt_enabled = interactive && isatty(STDOUT_FILENO);
+    shell_interactive = interactive;
+
+    // A prompt needs the cwd now, and a server forks its clients warm.
+    if (interactive || server_path != NULL) {
+        vars_init();
+    }
+
+    setup_signal_handlers(interactive);
+    select_spawn_backend();
+    const char *trace_path = getenv("MYSHELL_TRACE");
+    if (trace_path != NULL && *trace_path != '\0') {
+        trace_start(trace_path);
     }
-    printf("\nExiting shell...\n");
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    startup_phase("signals, backend");
+    if (server_path != NULL) {
+        return run_server(server_path);
+    }
+    if (sigchld_pipe[0] >= 0) {
+        event_add(sigchld_pipe[0], POLLIN, sigchld_event, NULL);
+    }
+
+    if (interactive) {
+        out_printf(COLOR_SUCCESS "Modern C shell v1.0\n" COLOR_RESET);
+        out_printf("Type 'help' for available commands, 'exit' to quit\n\n");
+    }
+    startup_phase("ready");
+
+    int status = run_commands(&input, interactive);
+    input_close(&input);
+
+    if (interactive) {
+        printf("\nExiting shell...\n");
+    }
+    return status;
+}